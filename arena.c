@@ -0,0 +1,238 @@
+/*
+** Arena allocation of the lattice buffers, see d2q9_internal.h.
+**
+** A simulation sizes all of its buffers up front and takes them from one
+** anonymous mapping, each aligned to ARENA_ALIGN. Depending on the page
+** policy the mapping is made with MAP_HUGETLB (explicit huge pages, which
+** need pages reserved in /proc/sys/vm/nr_hugepages), or aligned to the
+** huge page size and marked MADV_HUGEPAGE so that transparent huge pages
+** can back it, or marked MADV_NOHUGEPAGE. Anything that cannot be had
+** falls back to the next policy down, ending with plain base pages.
+*/
+
+#define _GNU_SOURCE
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "d2q9.h"
+#include "d2q9_internal.h"
+
+#define DEFAULT_HUGE_PAGE_SIZE (2L * 1024 * 1024)
+#define ALIAS_SPAN      4096  /* address bits compared by store to load forwarding and set indexing */
+#define ALIAS_MARGIN    256   /* rows must start this far from an aliased address */
+#define MAX_ROW_PADDING 64    /* cells */
+
+/* the size of explicit and transparent huge pages, from the kernel */
+static long huge_page_size(void)
+{
+  long  size = 0;
+  char  line[256];
+  FILE* fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+
+  if (fp != NULL)
+  {
+    if (fscanf(fp, "%ld", &size) != 1) size = 0;
+    fclose(fp);
+  }
+
+  if (size <= 0 && (fp = fopen("/proc/meminfo", "r")) != NULL)
+  {
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+      if (sscanf(line, "Hugepagesize: %ld kB", &size) == 1)
+      {
+        size *= 1024;
+        break;
+      }
+    }
+    fclose(fp);
+  }
+
+  return size > 0 ? size : DEFAULT_HUGE_PAGE_SIZE;
+}
+
+size_t arena_size(size_t size)
+{
+  return (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+int arena_create(t_arena* arena, size_t size, int pages)
+{
+  memset(arena, 0, sizeof(t_arena));
+  arena->huge_page_size = huge_page_size();
+  arena->base_page_size = sysconf(_SC_PAGESIZE);
+
+  if (size == 0) size = ARENA_ALIGN;
+
+#ifdef __linux__
+  if (pages == D2Q9_PAGES_HUGETLB)
+  {
+    const size_t mapped = (size + arena->huge_page_size - 1) / arena->huge_page_size * arena->huge_page_size;
+    void* base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (base != MAP_FAILED)
+    {
+      arena->base = base;
+      arena->size = mapped;
+      arena->map = base;
+      arena->map_size = mapped;
+      arena->pages = D2Q9_PAGES_HUGETLB;
+      return EXIT_SUCCESS;
+    }
+
+    /* no huge pages reserved, try transparent ones */
+    pages = D2Q9_PAGES_AUTO;
+  }
+
+  if (pages == D2Q9_PAGES_AUTO && size >= (size_t)arena->huge_page_size)
+  {
+    /* over-map so that the arena can start on a huge page boundary */
+    const size_t hp = arena->huge_page_size;
+    const size_t mapped = (size + hp - 1) / hp * hp + hp;
+    char* map = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (map != MAP_FAILED)
+    {
+      arena->map = map;
+      arena->map_size = mapped;
+      arena->base = (char*)(((uintptr_t)map + hp - 1) / hp * hp);
+      arena->size = mapped - (arena->base - map);
+      arena->pages = madvise(arena->base, arena->size, MADV_HUGEPAGE) == 0 ? D2Q9_PAGES_AUTO : D2Q9_PAGES_SMALL;
+      return EXIT_SUCCESS;
+    }
+  }
+
+  {
+    const size_t mapped = (size + arena->base_page_size - 1) / arena->base_page_size * arena->base_page_size;
+    void* base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base != MAP_FAILED)
+    {
+#ifdef MADV_NOHUGEPAGE
+      if (pages == D2Q9_PAGES_SMALL) madvise(base, mapped, MADV_NOHUGEPAGE);
+#endif
+      arena->base = base;
+      arena->size = mapped;
+      arena->map = base;
+      arena->map_size = mapped;
+      arena->pages = D2Q9_PAGES_SMALL;
+      return EXIT_SUCCESS;
+    }
+  }
+#endif
+
+  /* no mmap, or it failed */
+  if (posix_memalign((void**)&arena->base, ARENA_ALIGN, size))
+  {
+    arena->base = NULL;
+    d2q9_error("cannot allocate memory for the lattice arena", __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  memset(arena->base, 0, size);
+  arena->size = size;
+  arena->pages = D2Q9_PAGES_SMALL;
+
+  return EXIT_SUCCESS;
+}
+
+int arena_row_pitch(int nx, const size_t* elem_sizes, int nsizes)
+{
+  for (int pitch = nx; pitch <= nx + MAX_ROW_PADDING; pitch++)
+  {
+    int aliased = 0;
+
+    for (int ss = 0; ss < nsizes && !aliased; ss++)
+    {
+      /* the rows to the north and south, and those two apart as both
+      ** neighbours are streamed alongside the current row */
+      for (int dd = 1; dd <= 2 && !aliased; dd++)
+      {
+        const size_t offset = (dd * (size_t)pitch * elem_sizes[ss]) % ALIAS_SPAN;
+
+        if (offset < ALIAS_MARGIN || offset > ALIAS_SPAN - ALIAS_MARGIN) aliased = 1;
+      }
+    }
+
+    if (!aliased) return pitch;
+  }
+
+  return nx;
+}
+
+void* arena_alloc(t_arena* arena, size_t size)
+{
+  void* ptr;
+
+  size = arena_size(size);
+
+  if (arena->base == NULL || size > arena->size - arena->used) return NULL;
+
+  ptr = arena->base + arena->used;
+  arena->used += size;
+
+  return ptr;
+}
+
+long arena_page_size(const t_arena* arena)
+{
+  if (arena->pages == D2Q9_PAGES_HUGETLB) return arena->huge_page_size;
+
+#ifdef __linux__
+  /* transparent huge pages only count once the kernel has used them for
+  ** some of the arena, which /proc/self/smaps shows per mapping */
+  if (arena->pages == D2Q9_PAGES_AUTO)
+  {
+    char  line[512];
+    long  huge_kb = 0;
+    int   inside = 0;
+    FILE* fp = fopen("/proc/self/smaps", "r");
+
+    if (fp == NULL) return arena->base_page_size;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+      unsigned long start, end;
+      long kb;
+
+      if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+      {
+        inside = (uintptr_t)arena->base < end && (uintptr_t)arena->base + arena->used > start;
+      }
+      else if (inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+      {
+        huge_kb += kb;
+      }
+    }
+
+    fclose(fp);
+
+    if (huge_kb > 0) return arena->huge_page_size;
+  }
+#endif
+
+  return arena->base_page_size;
+}
+
+void arena_destroy(t_arena* arena)
+{
+#ifdef __linux__
+  if (arena->map != NULL)
+  {
+    munmap(arena->map, arena->map_size);
+    memset(arena, 0, sizeof(t_arena));
+    return;
+  }
+#endif
+
+  free(arena->base);
+  memset(arena, 0, sizeof(t_arena));
+}
@@ -0,0 +1,381 @@
+/*
+** Auto-tuning of d2q9-bgk (--autotune) and its tuning database.
+**
+** The fastest settings depend on the grid size and on the machine, so
+** --autotune times short runs of the actual parameters and obstacles with
+** candidate settings, one setting at a time with the best of the others
+** so far:
+**
+** 1. the number of threads: 1, 2, 4, ... and the number available;
+** 2. the software prefetch distance of the streaming step: 0, 8, 16, 32;
+** 3. plain or non-temporal stores in the collision;
+** 4. rows padded against 4 KiB aliasing, or stored nx cells apart;
+** 5. storage by rows, or in tiles of 16, 32 or 64 cells square, for the
+**    sizes smaller than nx.
+**
+** Each candidate runs AUTOTUNE_WARMUP untimed steps and then the best of
+** AUTOTUNE_REPEATS runs of AUTOTUNE_STEPS steps counts. The winner is
+** recorded in the tuning database, a text file with one line per grid
+** size, number of threads available and CPU model:
+**
+**   nx ny max_threads threads prefetch nt_stores row_pitch tile step_time cpu model
+**
+** where nt_stores is 0 or 1, row_pitch is 0 for the automatic padding and
+** tile is 0 for storage by rows. Later runs with the same key use the
+** recorded settings unless they are given on the command line. Lines
+** written before the tile column was added are ignored, and dropped when
+** the entry for their key is rewritten.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<ctype.h>
+#include <omp.h>
+
+#include "d2q9-bgk.h"
+
+#define AUTOTUNE_WARMUP  2       /* untimed steps of each candidate */
+#define AUTOTUNE_STEPS   20      /* timed steps of each repeat */
+#define AUTOTUNE_REPEATS 3       /* the fastest repeat counts */
+#define TUNING_DB_NAME   ".d2q9-bgk-tuning"
+#define TUNING_LINE      1024
+
+/* seconds per step of params and obstacles with the given settings */
+static double time_candidate(const t_param* params, const int* obstacles, const t_tuning* tuning);
+
+/* the model name of the first cpu in /proc/cpuinfo, or "unknown" */
+static void cpu_model(char* model, int size);
+
+/* non-zero if line is the database entry for this grid, threads and cpu;
+** if so and tuning is not NULL, its settings are stored there */
+static int match_entry(const char* line, const t_param* params, int max_threads, const char* model, t_tuning* tuning);
+
+/* non-zero if line is an entry for this grid, threads and cpu written
+** before the tile column was added */
+static int match_old_entry(const char* line, const t_param* params, int max_threads, const char* model);
+
+const char* tuning_db_path(void)
+{
+  static char path[1024];
+  const char* env = getenv("D2Q9_TUNING_DB");
+  const char* home = getenv("HOME");
+
+  if (env != NULL && env[0] != '\0') return env;
+
+  if (home == NULL || home[0] == '\0') return TUNING_DB_NAME;
+
+  snprintf(path, sizeof(path), "%s/%s", home, TUNING_DB_NAME);
+
+  return path;
+}
+
+int tuning_lookup(const char* dbfile, const t_param* params, t_tuning* tuning)
+{
+  char  line[TUNING_LINE];
+  char  model[256];
+  int   found = 0;
+  FILE* fp = fopen(dbfile, "r");
+
+  if (fp == NULL) return 0;
+
+  cpu_model(model, sizeof(model));
+
+  while (!found && fgets(line, sizeof(line), fp) != NULL)
+  {
+    found = match_entry(line, params, omp_get_max_threads(), model, tuning);
+  }
+
+  fclose(fp);
+
+  return found;
+}
+
+int autotune(const char* dbfile, const t_param* params, const int* obstacles, t_tuning* best)
+{
+  const int max_threads = omp_get_max_threads();
+  char      model[256];
+  char      tmpfile[1100];
+  char      line[TUNING_LINE];
+  double    best_time;
+  int       thread_counts[32];
+  int       nlevels = 0;
+  int       prefetches[] = { 0, 8, 16, 32 };
+  int       tiles[] = { 16, 32, 64 };
+  FILE*     in;
+  FILE*     out;
+
+  cpu_model(model, sizeof(model));
+
+  printf("==autotune==\n");
+  printf("CPU:\t\t\t\t%s\n", model);
+
+  /* start from the defaults, with the choice of stores resolved */
+  {
+    d2q9_options options;
+    d2q9_sim*    sim;
+
+    d2q9_default_options(&options);
+    sim = d2q9_create_with_options(params, obstacles, &options);
+
+    if (sim == NULL) die("could not create simulation", __LINE__, __FILE__);
+
+    best->nthreads = max_threads;
+    best->prefetch = 0;
+    best->streaming_stores = d2q9_streaming_stores(sim) ? D2Q9_STREAM_ON : D2Q9_STREAM_OFF;
+    best->row_pitch = 0;
+    best->tile = 0;
+    d2q9_destroy(sim);
+  }
+
+  best_time = time_candidate(params, obstacles, best);
+
+  /* 1. threads */
+  for (int nn = 1; nn < max_threads && nlevels < 31; nn *= 2)
+  {
+    thread_counts[nlevels++] = nn;
+  }
+  thread_counts[nlevels++] = max_threads;
+
+  for (int ll = 0; ll < nlevels; ll++)
+  {
+    t_tuning candidate = *best;
+    double   step_time;
+
+    if (thread_counts[ll] == best->nthreads) continue;
+
+    candidate.nthreads = thread_counts[ll];
+    step_time = time_candidate(params, obstacles, &candidate);
+
+    if (step_time < best_time)
+    {
+      best_time = step_time;
+      *best = candidate;
+    }
+  }
+
+  /* 2. prefetch distance */
+  for (int pp = 0; pp < (int)(sizeof(prefetches) / sizeof(prefetches[0])); pp++)
+  {
+    t_tuning candidate = *best;
+    double   step_time;
+
+    if (prefetches[pp] == best->prefetch) continue;
+
+    candidate.prefetch = prefetches[pp];
+    step_time = time_candidate(params, obstacles, &candidate);
+
+    if (step_time < best_time)
+    {
+      best_time = step_time;
+      *best = candidate;
+    }
+  }
+
+  /* 3. streaming stores, 4. row padding */
+  for (int ss = 0; ss < 2; ss++)
+  {
+    t_tuning candidate = *best;
+    double   step_time;
+
+    if (ss == 0) candidate.streaming_stores = best->streaming_stores == D2Q9_STREAM_ON ? D2Q9_STREAM_OFF : D2Q9_STREAM_ON;
+    else candidate.row_pitch = best->row_pitch == 0 ? params->nx : 0;
+
+    step_time = time_candidate(params, obstacles, &candidate);
+
+    if (step_time < best_time)
+    {
+      best_time = step_time;
+      *best = candidate;
+    }
+  }
+
+  /* 5. tiles, which replace the row pitch; a tile as wide as the grid
+  ** is only a padded row */
+  for (int tt = 0; tt < (int)(sizeof(tiles) / sizeof(tiles[0])) && tiles[tt] < params->nx; tt++)
+  {
+    t_tuning candidate = *best;
+    double   step_time;
+
+    candidate.tile = tiles[tt];
+    candidate.row_pitch = 0;
+    step_time = time_candidate(params, obstacles, &candidate);
+
+    if (step_time < best_time)
+    {
+      best_time = step_time;
+      *best = candidate;
+    }
+  }
+
+  printf("Tuned:\t\t\t\t%d threads, prefetch %d, nt-stores %s, pitch %s, tile %d\n", best->nthreads,
+         best->prefetch, best->streaming_stores == D2Q9_STREAM_ON ? "on" : "off", best->row_pitch ? "nx" : "auto",
+         best->tile);
+
+  /* rewrite the database with this entry replaced, then swap it in */
+  snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", dbfile);
+  out = fopen(tmpfile, "w");
+
+  if (out == NULL)
+  {
+    fprintf(stderr, "could not write tuning database: %s\n", tmpfile);
+    return EXIT_FAILURE;
+  }
+
+  in = fopen(dbfile, "r");
+
+  if (in == NULL)
+  {
+    fprintf(out, "# d2q9-bgk tuning database, see autotune.c\n"
+                 "# nx ny max_threads threads prefetch nt_stores row_pitch tile step_time cpu model\n");
+  }
+  else
+  {
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+      if (!match_entry(line, params, max_threads, model, NULL)
+          && !match_old_entry(line, params, max_threads, model)) fputs(line, out);
+    }
+    fclose(in);
+  }
+
+  fprintf(out, "%d %d %d %d %d %d %d %d %.6e %s\n", params->nx, params->ny, max_threads, best->nthreads,
+          best->prefetch, best->streaming_stores == D2Q9_STREAM_ON, best->row_pitch, best->tile, best_time, model);
+
+  if (fclose(out) != 0 || rename(tmpfile, dbfile) != 0)
+  {
+    fprintf(stderr, "could not write tuning database: %s\n", dbfile);
+    remove(tmpfile);
+    return EXIT_FAILURE;
+  }
+
+  printf("Tuning database:\t\t%s\n", dbfile);
+  fflush(stdout);
+
+  return EXIT_SUCCESS;
+}
+
+static double time_candidate(const t_param* params, const int* obstacles, const t_tuning* tuning)
+{
+  d2q9_options options;
+  d2q9_sim*    sim;
+  double       best = -1.0;
+
+  d2q9_default_options(&options);
+  options.streaming_stores = tuning->streaming_stores;
+  options.row_pitch = tuning->row_pitch;
+  options.tile = tuning->tile;
+  sim = d2q9_create_with_options(params, obstacles, &options);
+
+  if (sim == NULL) die("could not create simulation", __LINE__, __FILE__);
+
+  d2q9_set_threads(sim, tuning->nthreads);
+  d2q9_set_prefetch(sim, tuning->prefetch);
+  d2q9_step(sim, AUTOTUNE_WARMUP, NULL);
+
+  for (int rr = 0; rr < AUTOTUNE_REPEATS; rr++)
+  {
+    const double tic = wtime();
+    double       step_time;
+
+    d2q9_step(sim, AUTOTUNE_STEPS, NULL);
+    step_time = (wtime() - tic) / AUTOTUNE_STEPS;
+
+    if (best < 0.0 || step_time < best) best = step_time;
+  }
+
+  d2q9_destroy(sim);
+
+  printf("threads %d, prefetch %d, nt-stores %s, pitch %s, tile %d:\t%.3e (s/step)\n", tuning->nthreads,
+         tuning->prefetch, tuning->streaming_stores == D2Q9_STREAM_ON ? "on" : "off", tuning->row_pitch ? "nx" : "auto",
+         tuning->tile, best);
+
+  return best;
+}
+
+static void cpu_model(char* model, int size)
+{
+  char  line[512];
+  FILE* fp = fopen("/proc/cpuinfo", "r");
+
+  snprintf(model, size, "unknown");
+
+  if (fp == NULL) return;
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    char* value = strchr(line, ':');
+
+    if (!strncmp(line, "model name", 10) && value != NULL)
+    {
+      value++;
+      while (*value == ' ' || *value == '\t') value++;
+      value[strcspn(value, "\n")] = '\0';
+      snprintf(model, size, "%s", value);
+      break;
+    }
+  }
+
+  fclose(fp);
+}
+
+static int match_entry(const char* line, const t_param* params, int max_threads, const char* model, t_tuning* tuning)
+{
+  int    nx, ny, entry_threads, nthreads, prefetch, nt_stores, row_pitch, tile;
+  double step_time;
+  int    tile_end = 0;
+  int    offset = 0;
+  char   entry_model[TUNING_LINE];
+
+  if (line[0] == '#') return 0;
+
+  /* an older line has the step time where the tile is, which the first
+  ** digit of would otherwise be read as */
+  if (sscanf(line, "%d %d %d %d %d %d %d %d%n %lf %n", &nx, &ny, &entry_threads, &nthreads, &prefetch, &nt_stores,
+             &row_pitch, &tile, &tile_end, &step_time, &offset) != 9 || offset == 0 || !isspace(line[tile_end]))
+    return 0;
+
+  /* the model is the rest of the line */
+  snprintf(entry_model, sizeof(entry_model), "%s", line + offset);
+  entry_model[strcspn(entry_model, "\n")] = '\0';
+
+  if (nx != params->nx || ny != params->ny || entry_threads != max_threads || strcmp(entry_model, model))
+    return 0;
+
+  if (tuning != NULL)
+  {
+    tuning->nthreads = nthreads;
+    tuning->prefetch = prefetch;
+    tuning->streaming_stores = nt_stores ? D2Q9_STREAM_ON : D2Q9_STREAM_OFF;
+    tuning->row_pitch = row_pitch;
+    tuning->tile = tile;
+  }
+
+  return 1;
+}
+
+static int match_old_entry(const char* line, const t_param* params, int max_threads, const char* model)
+{
+  int    nx, ny, entry_threads, nthreads, prefetch, nt_stores, row_pitch;
+  double step_time;
+  int    pitch_end = 0;
+  int    time_end = 0;
+  int    offset = 0;
+  char   entry_model[TUNING_LINE];
+
+  if (line[0] == '#') return 0;
+
+  if (sscanf(line, "%d %d %d %d %d %d %d%n %lf%n %n", &nx, &ny, &entry_threads, &nthreads, &prefetch, &nt_stores,
+             &row_pitch, &pitch_end, &step_time, &time_end, &offset) != 8 || offset == 0)
+    return 0;
+
+  /* the step time was written with %.6e, where a current line has the
+  ** tile, an integer */
+  if ((int)strspn(line + pitch_end, " \t+-0123456789") >= time_end - pitch_end) return 0;
+
+  /* the model is the rest of the line */
+  snprintf(entry_model, sizeof(entry_model), "%s", line + offset);
+  entry_model[strcspn(entry_model, "\n")] = '\0';
+
+  return nx == params->nx && ny == params->ny && entry_threads == max_threads && !strcmp(entry_model, model);
+}
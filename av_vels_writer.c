@@ -0,0 +1,181 @@
+/*
+** Streaming output of the average velocities of a d2q9-bgk run.
+**
+** Instead of a buffer of maxIters floats written out after the last step,
+** the run hands its average velocities to a writer thread AV_VELS_CHUNK
+** steps at a time. The thread formats and appends each chunk to the file
+** and flushes it, so memory stays bounded however long the run is, and the
+** file can be followed with tail -f, or read from a pipe, while the run
+** goes on. The run only waits for the writer when all AV_VELS_CHUNKS
+** chunks are still being written. The file is the same as the one
+** write_av_vels() writes.
+*/
+
+#define _GNU_SOURCE
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include <pthread.h>
+
+#include "d2q9-bgk.h"
+
+#define AV_VELS_CHUNK  1024     /* steps handed to the writer at a time */
+#define AV_VELS_CHUNKS 4        /* chunks being filled or written */
+
+struct t_av_vels_writer
+{
+  FILE*           fp;
+  float           chunks[AV_VELS_CHUNKS][AV_VELS_CHUNK];
+  int             counts[AV_VELS_CHUNKS];  /* steps in each chunk handed over */
+  int             used;         /* steps in the chunk being filled */
+  long            filled;       /* chunks handed to the writer so far */
+  long            written;      /* and written by it */
+  int             done;         /* no more chunks will come */
+  int             error;        /* a write failed */
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;      /* filled, written or done changed */
+  pthread_t       thread;
+};
+
+/* the writer thread: write chunks as they are handed over until done */
+static void* write_chunks(void* arg);
+
+/* hand the chunk being filled to the writer thread */
+static void hand_over(t_av_vels_writer* writer);
+
+t_av_vels_writer* av_vels_writer_open(const char* filename)
+{
+  t_av_vels_writer* writer = calloc(1, sizeof(t_av_vels_writer));
+
+  if (writer == NULL) return NULL;
+
+  /* a stream of its own on stdout's file, so that stdout can be moved */
+  if (!strcmp(filename, "-"))
+  {
+    const int fd = dup(STDOUT_FILENO);
+
+    writer->fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (writer->fp == NULL && fd >= 0) close(fd);
+  }
+  else
+  {
+    writer->fp = fopen(filename, "w");
+  }
+
+  if (writer->fp == NULL)
+  {
+    fprintf(stderr, "could not open file: %s\n", filename);
+    free(writer);
+    return NULL;
+  }
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->changed, NULL);
+
+  if (pthread_create(&writer->thread, NULL, write_chunks, writer) != 0)
+  {
+    fclose(writer->fp);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    free(writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+void av_vels_writer_add(t_av_vels_writer* writer, float av_vel)
+{
+  writer->chunks[writer->filled % AV_VELS_CHUNKS][writer->used++] = av_vel;
+
+  if (writer->used == AV_VELS_CHUNK) hand_over(writer);
+}
+
+int av_vels_writer_close(t_av_vels_writer* writer)
+{
+  int error;
+
+  if (writer->used > 0) hand_over(writer);
+
+  pthread_mutex_lock(&writer->lock);
+  writer->done = 1;
+  pthread_cond_signal(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+
+  pthread_join(writer->thread, NULL);
+
+  error = writer->error;
+  if (fclose(writer->fp) != 0) error = 1;
+
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->changed);
+  free(writer);
+
+  return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void hand_over(t_av_vels_writer* writer)
+{
+  pthread_mutex_lock(&writer->lock);
+
+  writer->counts[writer->filled % AV_VELS_CHUNKS] = writer->used;
+  writer->filled++;
+  writer->used = 0;
+  pthread_cond_signal(&writer->changed);
+
+  /* the next chunk may still be being written */
+  while (writer->filled - writer->written >= AV_VELS_CHUNKS)
+  {
+    pthread_cond_wait(&writer->changed, &writer->lock);
+  }
+
+  pthread_mutex_unlock(&writer->lock);
+}
+
+static void* write_chunks(void* arg)
+{
+  t_av_vels_writer* writer = arg;
+  long              step = 0;
+
+  for (;;)
+  {
+    const float* chunk;
+    int          count;
+    int          error = 0;
+
+    pthread_mutex_lock(&writer->lock);
+
+    while (writer->written == writer->filled && !writer->done)
+    {
+      pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+
+    if (writer->written == writer->filled)
+    {
+      pthread_mutex_unlock(&writer->lock);
+      break;
+    }
+
+    chunk = writer->chunks[writer->written % AV_VELS_CHUNKS];
+    count = writer->counts[writer->written % AV_VELS_CHUNKS];
+    pthread_mutex_unlock(&writer->lock);
+
+    /* as write_av_vels() */
+    for (int ii = 0; ii < count; ii++)
+    {
+      if (fprintf(writer->fp, "%ld:\t%.12E\n", step++, chunk[ii]) < 0) error = 1;
+    }
+
+    if (fflush(writer->fp) != 0) error = 1;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->written++;
+    writer->error |= error;
+    pthread_cond_signal(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+  }
+
+  return NULL;
+}
@@ -0,0 +1,509 @@
+/*
+** Batch mode of d2q9-bgk: run many independent simulations in one
+** process, packed onto disjoint sets of cores.
+**
+** Small grids stop scaling long before a whole node is used, so instead
+** of running the jobs one after another on every core, each job gets a
+** team of cores of its own and the teams run concurrently:
+**
+** 1. every job (or every distinct grid size, since the cost of a step
+**    hardly depends on the obstacles) is timed for a few steps with
+**    1, 2, 4, ... threads, up to the number of cores we may run on;
+**
+** 2. with fewer jobs than cores, each job starts with one core and the
+**    job with the longest estimated run time is repeatedly moved to the
+**    next thread count while that makes it at least BATCH_MIN_GAIN faster
+**    and enough cores are left. With at least as many jobs as cores every
+**    team has one core and the jobs are dealt out longest first to the
+**    team with the least work (LPT scheduling);
+**
+** 3. each team is a pthread which restricts itself to its cores before
+**    its first parallel region, so libgomp creates the team's own pool of
+**    OpenMP threads there, and then pins the thread of the pool with id t
+**    to the t'th core of the team. The pool is reused for every parallel
+**    region started by that pthread, so the pinning holds for all of its
+**    jobs.
+**
+** The job file has one 'paramfile obstaclefile [prefix]' per line; blank
+** lines and '#' comments are skipped. Job n writes <prefix>final_state.dat
+** and <prefix>av_vels.dat, the prefix defaulting to 'job<n>_'.
+*/
+
+#define _GNU_SOURCE
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <omp.h>
+
+#include "d2q9-bgk.h"
+
+#define BATCH_PROBE_WARMUP 2     /* untimed steps before a probe */
+#define BATCH_PROBE_STEPS  20    /* timed steps of a probe */
+#define BATCH_MIN_GAIN     0.9   /* more threads must cut the step time to this fraction */
+#define BATCH_MAX_LEVELS   32    /* thread counts probed: 1, 2, 4, ... and the number of cores */
+
+/* one line of the job file */
+typedef struct
+{
+  char     paramfile[512];
+  char     obstaclefile[512];
+  char     prefix[256];
+  t_param  params;
+  int*     obstacles;
+  double   step_time[BATCH_MAX_LEVELS]; /* seconds per step with thread_counts[ll] threads */
+  int      level;                       /* index of the thread count chosen */
+  int      team;
+  double   elapsed;                     /* measured run time */
+  float    reynolds;
+  const char* error;                    /* why the job failed, NULL if it ran */
+} t_job;
+
+/* a set of cores and the jobs run on them, one after another */
+typedef struct
+{
+  pthread_t thread;
+  int       nthreads;
+  const int* cpus;                      /* nthreads cpu numbers */
+  t_job**   jobs;
+  int       njobs;
+  double    estimate;                   /* sum of the estimated run times of the jobs */
+} t_team;
+
+static int read_jobs(const char* jobfile, t_job** jobs_out);
+static int allowed_cpus(int* cpus, int max);
+static void probe_scaling(t_job* jobs, int njobs, const int* thread_counts, int nlevels);
+static double estimate(const t_job* job, int level);
+static void pin_team(const t_team* team);
+static void* run_team(void* arg);
+static int run_job(t_job* job, int nthreads);
+
+int run_batch(const char* jobfile)
+{
+  t_job*  jobs = NULL;
+  t_team* teams = NULL;
+  t_job** order = NULL;         /* jobs sorted by decreasing estimate */
+  int*    cpus;                 /* cores we are allowed to run on */
+  int     ncpus;
+  int     njobs;
+  int     nteams;
+  int     thread_counts[BATCH_MAX_LEVELS];
+  int     nlevels = 0;
+  double  tic, toc;
+  int     nfailed = 0;
+
+  njobs = read_jobs(jobfile, &jobs);
+
+  cpus = malloc(sizeof(int) * CPU_SETSIZE);
+
+  if (cpus == NULL) die("cannot allocate memory for cpu list", __LINE__, __FILE__);
+
+  ncpus = allowed_cpus(cpus, CPU_SETSIZE);
+
+  for (int pp = 1; pp < ncpus && nlevels < BATCH_MAX_LEVELS - 1; pp *= 2)
+  {
+    thread_counts[nlevels++] = pp;
+  }
+  thread_counts[nlevels++] = ncpus;
+
+  probe_scaling(jobs, njobs, thread_counts, nlevels);
+
+  /* split the cores between the jobs */
+  order = malloc(sizeof(t_job*) * njobs);
+
+  if (order == NULL) die("cannot allocate memory for batch schedule", __LINE__, __FILE__);
+
+  for (int jj = 0; jj < njobs; jj++)
+  {
+    jobs[jj].level = 0;
+    order[jj] = &jobs[jj];
+  }
+
+  if (njobs < ncpus)
+  {
+    int spare = ncpus - njobs;
+
+    for (;;)
+    {
+      t_job* slowest = &jobs[0];
+      int    extra;
+
+      for (int jj = 1; jj < njobs; jj++)
+      {
+        if (estimate(&jobs[jj], jobs[jj].level) > estimate(slowest, slowest->level)) slowest = &jobs[jj];
+      }
+
+      /* the whole batch takes as long as its slowest job, so stop as soon
+      ** as that one cannot be sped up */
+      if (slowest->level + 1 >= nlevels) break;
+
+      extra = thread_counts[slowest->level + 1] - thread_counts[slowest->level];
+
+      if (extra > spare
+          || slowest->step_time[slowest->level + 1] > BATCH_MIN_GAIN * slowest->step_time[slowest->level])
+        break;
+
+      slowest->level++;
+      spare -= extra;
+    }
+
+    nteams = njobs;
+  }
+  else
+  {
+    nteams = ncpus;
+  }
+
+  /* longest first, for LPT */
+  for (int jj = 1; jj < njobs; jj++)
+  {
+    t_job* job = order[jj];
+    int    kk = jj;
+
+    for (; kk > 0 && estimate(order[kk - 1], order[kk - 1]->level) < estimate(job, job->level); kk--)
+    {
+      order[kk] = order[kk - 1];
+    }
+    order[kk] = job;
+  }
+
+  teams = calloc(nteams, sizeof(t_team));
+
+  if (teams == NULL) die("cannot allocate memory for batch teams", __LINE__, __FILE__);
+
+  for (int tt = 0; tt < nteams; tt++)
+  {
+    teams[tt].jobs = malloc(sizeof(t_job*) * njobs);
+
+    if (teams[tt].jobs == NULL) die("cannot allocate memory for batch teams", __LINE__, __FILE__);
+  }
+
+  if (njobs < ncpus)
+  {
+    int next_cpu = 0;
+
+    for (int jj = 0; jj < njobs; jj++)
+    {
+      t_team* team = &teams[jj];
+
+      team->nthreads = thread_counts[jobs[jj].level];
+      team->cpus = &cpus[next_cpu];
+      team->jobs[team->njobs++] = &jobs[jj];
+      team->estimate = estimate(&jobs[jj], jobs[jj].level);
+      jobs[jj].team = jj;
+      next_cpu += team->nthreads;
+    }
+  }
+  else
+  {
+    for (int tt = 0; tt < nteams; tt++)
+    {
+      teams[tt].nthreads = 1;
+      teams[tt].cpus = &cpus[tt];
+    }
+
+    for (int jj = 0; jj < njobs; jj++)
+    {
+      t_job* job = order[jj];
+      int    least = 0;
+
+      for (int tt = 1; tt < nteams; tt++)
+      {
+        if (teams[tt].estimate < teams[least].estimate) least = tt;
+      }
+
+      teams[least].jobs[teams[least].njobs++] = job;
+      teams[least].estimate += estimate(job, job->level);
+      job->team = least;
+    }
+  }
+
+  printf("==batch==\n");
+  printf("Jobs, cores:\t\t\t%d\t%d\n", njobs, ncpus);
+  printf("%-4s %-24s %8s %8s %14s\n", "job", "params", "team", "threads", "estimate (s)");
+  for (int jj = 0; jj < njobs; jj++)
+  {
+    printf("%-4d %-24s %8d %8d %14.3f\n", jj, jobs[jj].paramfile, jobs[jj].team,
+           thread_counts[jobs[jj].level], estimate(&jobs[jj], jobs[jj].level));
+  }
+  fflush(stdout);
+
+  tic = wtime();
+
+  for (int tt = 0; tt < nteams; tt++)
+  {
+    if (pthread_create(&teams[tt].thread, NULL, run_team, &teams[tt]) != 0)
+      die("could not start batch team", __LINE__, __FILE__);
+  }
+
+  for (int tt = 0; tt < nteams; tt++)
+  {
+    pthread_join(teams[tt].thread, NULL);
+  }
+
+  toc = wtime();
+
+  printf("==done==\n");
+  printf("%-4s %-24s %14s %14s %20s\n", "job", "params", "estimate (s)", "elapsed (s)", "Reynolds number");
+  for (int jj = 0; jj < njobs; jj++)
+  {
+    if (jobs[jj].error != NULL)
+    {
+      printf("%-4d %-24s %14.3f %14s %20s\n", jj, jobs[jj].paramfile,
+             estimate(&jobs[jj], jobs[jj].level), "-", "failed");
+      nfailed++;
+      continue;
+    }
+
+    printf("%-4d %-24s %14.3f %14.3f %20.12E\n", jj, jobs[jj].paramfile,
+           estimate(&jobs[jj], jobs[jj].level), jobs[jj].elapsed, jobs[jj].reynolds);
+  }
+  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
+  printf("Simulations per hour:\t\t%.1f\n", toc > tic ? (njobs - nfailed) * 3600.0 / (toc - tic) : 0.0);
+  fflush(stdout);
+
+  /* the teams only record errors, so that no job exits the process */
+  for (int jj = 0; jj < njobs; jj++)
+  {
+    if (jobs[jj].error != NULL) fprintf(stderr, "job %d (%s): %s\n", jj, jobs[jj].paramfile, jobs[jj].error);
+  }
+
+  for (int tt = 0; tt < nteams; tt++)
+  {
+    free(teams[tt].jobs);
+  }
+  for (int jj = 0; jj < njobs; jj++)
+  {
+    free(jobs[jj].obstacles);
+  }
+  free(teams);
+  free(order);
+  free(cpus);
+  free(jobs);
+
+  return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int read_jobs(const char* jobfile, t_job** jobs_out)
+{
+  FILE*  fp;                    /* file pointer */
+  char   line[1536];            /* one line of the job file */
+  t_job* jobs = NULL;
+  int    njobs = 0;
+  int    capacity = 0;
+
+  fp = fopen(jobfile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(line, "could not open job file: %s", jobfile);
+    die(line, __LINE__, __FILE__);
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    t_job* job;
+    char   first;
+    int    nread;
+
+    if (sscanf(line, " %c", &first) != 1 || first == '#') continue;
+
+    if (njobs == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 16;
+      jobs = realloc(jobs, sizeof(t_job) * capacity);
+
+      if (jobs == NULL) die("cannot allocate memory for jobs", __LINE__, __FILE__);
+    }
+
+    job = &jobs[njobs];
+    memset(job, 0, sizeof(t_job));
+
+    nread = sscanf(line, "%511s %511s %255s", job->paramfile, job->obstaclefile, job->prefix);
+
+    if (nread < 2) die("expected 'paramfile obstaclefile [prefix]' per line in job file", __LINE__, __FILE__);
+    if (nread == 2) sprintf(job->prefix, "job%d_", njobs);
+
+    if (d2q9_read_params(job->paramfile, &job->params) != EXIT_SUCCESS)
+      die("could not load parameters", __LINE__, __FILE__);
+
+    job->obstacles = malloc(sizeof(int) * (job->params.ny * job->params.nx));
+
+    if (job->obstacles == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+
+    if (d2q9_read_obstacles(job->obstaclefile, &job->params, job->obstacles) != EXIT_SUCCESS)
+      die("could not load obstacles", __LINE__, __FILE__);
+
+    njobs++;
+  }
+
+  fclose(fp);
+
+  if (njobs == 0) die("job file has no jobs", __LINE__, __FILE__);
+
+  *jobs_out = jobs;
+
+  return njobs;
+}
+
+/* the cpus in our affinity mask, e.g. as given by the batch system */
+static int allowed_cpus(int* cpus, int max)
+{
+  cpu_set_t set;
+  int ncpus = 0;
+
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+  {
+    for (int cc = 0; cc < CPU_SETSIZE && ncpus < max; cc++)
+    {
+      if (CPU_ISSET(cc, &set)) cpus[ncpus++] = cc;
+    }
+  }
+
+  if (ncpus == 0)
+  {
+    ncpus = omp_get_num_procs();
+    for (int cc = 0; cc < ncpus; cc++) cpus[cc] = cc;
+  }
+
+  return ncpus;
+}
+
+static void probe_scaling(t_job* jobs, int njobs, const int* thread_counts, int nlevels)
+{
+  for (int jj = 0; jj < njobs; jj++)
+  {
+    t_job* job = &jobs[jj];
+    int    done = 0;
+
+    /* the cost of a step depends on the grid size rather than the obstacles */
+    for (int kk = 0; kk < jj && !done; kk++)
+    {
+      if (jobs[kk].params.nx == job->params.nx && jobs[kk].params.ny == job->params.ny)
+      {
+        memcpy(job->step_time, jobs[kk].step_time, sizeof(job->step_time));
+        done = 1;
+      }
+    }
+
+    for (int ll = 0; ll < nlevels && !done; ll++)
+    {
+      d2q9_sim* sim = d2q9_create(&job->params, job->obstacles);
+      double    tic;
+
+      if (sim == NULL) die("could not create simulation", __LINE__, __FILE__);
+
+      d2q9_set_threads(sim, thread_counts[ll]);
+      d2q9_step(sim, BATCH_PROBE_WARMUP, NULL);
+      tic = wtime();
+      d2q9_step(sim, BATCH_PROBE_STEPS, NULL);
+      job->step_time[ll] = (wtime() - tic) / BATCH_PROBE_STEPS;
+      d2q9_destroy(sim);
+    }
+  }
+}
+
+static double estimate(const t_job* job, int level)
+{
+  return job->params.maxIters * job->step_time[level];
+}
+
+static void pin_team(const t_team* team)
+{
+  cpu_set_t set;
+
+  /* threads created by this one, i.e. its OpenMP pool, inherit the mask */
+  CPU_ZERO(&set);
+  for (int cc = 0; cc < team->nthreads; cc++) CPU_SET(team->cpus[cc], &set);
+  sched_setaffinity(0, sizeof(set), &set);
+
+#pragma omp parallel num_threads(team->nthreads)
+  {
+    const int tid = omp_get_thread_num();
+    cpu_set_t one;
+
+    if (tid < team->nthreads)
+    {
+      CPU_ZERO(&one);
+      CPU_SET(team->cpus[tid], &one);
+      sched_setaffinity(0, sizeof(one), &one);
+    }
+  }
+}
+
+static void* run_team(void* arg)
+{
+  t_team* team = arg;
+
+  pin_team(team);
+
+  /* the team size of this thread's parallel regions from here on, so that
+  ** d2q9_create() first touches each lattice with the pinned pool */
+  omp_set_num_threads(team->nthreads);
+
+  /* a failed job leaves its error in the job for run_batch() to report */
+  for (int jj = 0; jj < team->njobs; jj++)
+  {
+    run_job(team->jobs[jj], team->nthreads);
+  }
+
+  return NULL;
+}
+
+static int run_job(t_job* job, int nthreads)
+{
+  const t_param params = job->params;
+  const int ncells = params.ny * params.nx;
+  char      filename[1024];
+  float*    av_vels;
+  float*    fields;             /* u_x, u_y, u and pressure */
+  d2q9_sim* sim;
+  double    tic;
+
+  av_vels = malloc(sizeof(float) * params.maxIters);
+  fields = malloc(sizeof(float) * 4 * ncells);
+
+  if (av_vels == NULL || fields == NULL)
+  {
+    job->error = "cannot allocate memory for job results";
+    free(fields);
+    free(av_vels);
+    return EXIT_FAILURE;
+  }
+
+  tic = wtime();
+
+  /* created on the team's own cores, with the team's thread count, so
+  ** that its pages are local to them */
+  sim = d2q9_create(&params, job->obstacles);
+
+  if (sim == NULL)
+  {
+    job->error = "could not create simulation";
+    free(fields);
+    free(av_vels);
+    return EXIT_FAILURE;
+  }
+
+  d2q9_set_threads(sim, nthreads);
+  d2q9_step(sim, params.maxIters, av_vels);
+
+  job->elapsed = wtime() - tic;
+  job->reynolds = d2q9_reynolds(sim);
+
+  d2q9_get_fields(sim, fields, fields + ncells, fields + 2 * ncells, fields + 3 * ncells);
+  sprintf(filename, "%sfinal_state.dat", job->prefix);
+  if (write_final_state(filename, params, job->obstacles, fields, fields + ncells, fields + 2 * ncells,
+                        fields + 3 * ncells) != EXIT_SUCCESS)
+    job->error = "could not write final state";
+  sprintf(filename, "%sav_vels.dat", job->prefix);
+  if (write_av_vels(filename, av_vels, params.maxIters, 1) != EXIT_SUCCESS) job->error = "could not write av_vels";
+
+  d2q9_destroy(sim);
+  free(fields);
+  free(av_vels);
+
+  return job->error == NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
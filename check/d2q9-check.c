@@ -0,0 +1,414 @@
+/*
+** Result checker for d2q9-bgk, replacing check.py.
+**
+** Compares av_vels.dat and final_state.dat against reference results the
+** way check.py does: for each value (the average velocity of every step,
+** and the pressure of every cell) the difference diff = ref - sim and its
+** percentage 100 * diff / sim are formed, and a check fails if the largest
+** percentage in magnitude is above the tolerance or not finite. The output
+** is the same as that of check.py.
+**
+** The files are streamed a line at a time rather than loaded, and the
+** av_vels and final_state pairs are compared concurrently. States saved by
+** --save-state can be compared in the same way, speed by speed, with
+** --ref-state-file and --state-file.
+**
+** Usage: d2q9-check [--tolerance <percent>]
+**                   --ref-av-vels-file <file> --ref-final-state-file <file>
+**                   --av-vels-file <file> --final-state-file <file>
+**                   [--ref-state-file <file> --state-file <file>]
+**
+** Options may also be written --option=value. Exits with 1 if any check
+** fails, as check.py does.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<math.h>
+
+#define LINE_LENGTH 1024
+#define READ_BUFFER (1 << 20)   /* stdio buffer of each file */
+#define STATE_MAGIC "D2Q9STA1"  /* see d2q9_save_state() */
+#define STATE_CHUNK 4096        /* floats read from a state file at a time */
+
+/* the statistics check.py prints */
+typedef struct
+{
+  long   count;         /* values compared */
+  long   max_index;     /* index of the largest percentage difference */
+  double max_diff;
+  double max_pcnt;
+  double sim_val;
+  double ref_val;
+  double total;         /* sum of the absolute differences */
+  int    jj, ii;        /* coordinates of max_index, for final_state */
+  int    kk;            /* speed of max_index, for states */
+  int    error;         /* non-zero if the files could not be compared */
+} t_diffs;
+
+/* compare two files of the given kind, filling in diffs */
+static void compare_av_vels(const char* ref_file, const char* sim_file, t_diffs* diffs);
+static void compare_final_state(const char* ref_file, const char* sim_file, t_diffs* diffs);
+static void compare_state(const char* ref_file, const char* sim_file, t_diffs* diffs);
+
+/* account for one pair of values */
+static inline int add_value(t_diffs* diffs, double ref, double sim);
+
+/* classify by the exponent bits, which holds under -ffast-math */
+static inline int is_nan(double x);
+static inline int is_finite(double x);
+
+static FILE* open_file(const char* filename);
+static int failed(const t_diffs* diffs, double tolerance);
+static void usage(const char* exe);
+
+int main(int argc, char* argv[])
+{
+  const char* files[6] = { NULL };  /* ref av_vels, ref final_state, av_vels, final_state, ref state, state */
+  const char* names[6] = { "--ref-av-vels-file", "--ref-final-state-file", "--av-vels-file",
+                           "--final-state-file", "--ref-state-file", "--state-file" };
+  double  tolerance = 1.0;     /* % */
+  t_diffs av_vels, final_state, state;
+  int     fail = 0;
+
+  for (int aa = 1; aa < argc; aa++)
+  {
+    const char* value = NULL;
+    size_t      len = strcspn(argv[aa], "=");
+    int         known = 0;
+
+    if (argv[aa][len] == '=') value = argv[aa] + len + 1;
+    else if (aa + 1 < argc) value = argv[aa + 1];
+
+    if (value == NULL) usage(argv[0]);
+
+    if (len == strlen("--tolerance") && !strncmp(argv[aa], "--tolerance", len))
+    {
+      tolerance = atof(value);
+      known = 1;
+    }
+
+    for (int ff = 0; ff < 6 && !known; ff++)
+    {
+      if (len == strlen(names[ff]) && !strncmp(argv[aa], names[ff], len))
+      {
+        files[ff] = value;
+        known = 1;
+      }
+    }
+
+    if (!known) usage(argv[0]);
+    if (argv[aa][len] != '=') aa++;
+  }
+
+  if (files[0] == NULL || files[1] == NULL || files[2] == NULL || files[3] == NULL
+      || (files[4] == NULL) != (files[5] == NULL))
+    usage(argv[0]);
+
+  memset(&state, 0, sizeof(state));
+
+#pragma omp parallel sections
+  {
+#pragma omp section
+    compare_av_vels(files[0], files[2], &av_vels);
+#pragma omp section
+    compare_final_state(files[1], files[3], &final_state);
+#pragma omp section
+    if (files[4] != NULL) compare_state(files[4], files[5], &state);
+  }
+
+  if (av_vels.error || final_state.error || state.error) return EXIT_FAILURE;
+
+  printf("Total difference in av_vels : %.12E\n", av_vels.total);
+  printf("Biggest difference (at step %ld) : %.12E\n", av_vels.max_index, av_vels.max_diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n", av_vels.sim_val, av_vels.ref_val, av_vels.max_pcnt);
+  printf("\n");
+  printf("Total difference in final_state : %.12E\n", final_state.total);
+  printf("Biggest difference (at coord (%d,%d)) : %.12E\n", final_state.jj, final_state.ii, final_state.max_diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n", final_state.sim_val, final_state.ref_val, final_state.max_pcnt);
+  printf("\n");
+
+  if (files[4] != NULL)
+  {
+    printf("Total difference in state : %.12E\n", state.total);
+    printf("Biggest difference (at coord (%d,%d) speed %d) : %.12E\n", state.jj, state.ii, state.kk, state.max_diff);
+    printf("  %.12E vs. %.12E = %.2g%%\n", state.sim_val, state.ref_val, state.max_pcnt);
+    printf("\n");
+  }
+
+  if (failed(&final_state, tolerance))
+  {
+    printf("final state failed check\n");
+    fail = 1;
+  }
+  if (failed(&av_vels, tolerance))
+  {
+    printf("av_vels failed check\n");
+    fail = 1;
+  }
+  if (files[4] != NULL && failed(&state, tolerance))
+  {
+    printf("state failed check\n");
+    fail = 1;
+  }
+
+  if (fail) return 1;
+
+  printf("%s tests passed!\n", files[4] != NULL ? "All" : "Both");
+
+  return EXIT_SUCCESS;
+}
+
+static void compare_av_vels(const char* ref_file, const char* sim_file, t_diffs* diffs)
+{
+  char  ref_line[LINE_LENGTH], sim_line[LINE_LENGTH];
+  FILE* ref = open_file(ref_file);
+  FILE* sim = open_file(sim_file);
+
+  memset(diffs, 0, sizeof(t_diffs));
+
+  if (ref == NULL || sim == NULL)
+  {
+    diffs->error = 1;
+  }
+  else
+  {
+    for (;;)
+    {
+      char* ref_ok = fgets(ref_line, LINE_LENGTH, ref);
+      char* sim_ok = fgets(sim_line, LINE_LENGTH, sim);
+      int   step;
+      double ref_val, sim_val;
+
+      if (ref_ok == NULL || sim_ok == NULL)
+      {
+        if (ref_ok != sim_ok)
+        {
+          printf("Different number of steps in av_vels files\n");
+          diffs->error = 1;
+        }
+        break;
+      }
+
+      /* 'step:\tvalue', the value being the second column */
+      if (sscanf(ref_line, "%d: %lf", &step, &ref_val) != 2 || sscanf(sim_line, "%d: %lf", &step, &sim_val) != 2)
+      {
+        printf("Could not read av_vels line %ld\n", diffs->count + 1);
+        diffs->error = 1;
+        break;
+      }
+
+      add_value(diffs, ref_val, sim_val);
+    }
+  }
+
+  if (ref != NULL) fclose(ref);
+  if (sim != NULL) fclose(sim);
+}
+
+static void compare_final_state(const char* ref_file, const char* sim_file, t_diffs* diffs)
+{
+  char  ref_line[LINE_LENGTH], sim_line[LINE_LENGTH];
+  FILE* ref = open_file(ref_file);
+  FILE* sim = open_file(sim_file);
+
+  memset(diffs, 0, sizeof(t_diffs));
+
+  if (ref == NULL || sim == NULL)
+  {
+    diffs->error = 1;
+  }
+  else
+  {
+    for (;;)
+    {
+      char*  ref_ok = fgets(ref_line, LINE_LENGTH, ref);
+      char*  sim_ok = fgets(sim_line, LINE_LENGTH, sim);
+      int    ref_jj, ref_ii, sim_jj, sim_ii;
+      double ref_val, sim_val, skip;
+
+      if (ref_ok == NULL || sim_ok == NULL)
+      {
+        /* as check.py, a missing cell is a difference in coordinates */
+        if (ref_ok != sim_ok)
+        {
+          printf("Final state files coordinates were not the same\n");
+          diffs->error = 1;
+        }
+        break;
+      }
+
+      /* 'jj ii u_x u_y u pressure obstacle', compared on pressure */
+      if (sscanf(ref_line, "%d %d %lf %lf %lf %lf", &ref_jj, &ref_ii, &skip, &skip, &skip, &ref_val) != 6
+          || sscanf(sim_line, "%d %d %lf %lf %lf %lf", &sim_jj, &sim_ii, &skip, &skip, &skip, &sim_val) != 6)
+      {
+        printf("Could not read final_state line %ld\n", diffs->count + 1);
+        diffs->error = 1;
+        break;
+      }
+
+      if (ref_jj != sim_jj || ref_ii != sim_ii)
+      {
+        printf("Final state files coordinates were not the same\n");
+        diffs->error = 1;
+        break;
+      }
+
+      if (add_value(diffs, ref_val, sim_val))
+      {
+        diffs->jj = sim_jj;
+        diffs->ii = sim_ii;
+      }
+    }
+  }
+
+  if (ref != NULL) fclose(ref);
+  if (sim != NULL) fclose(sim);
+}
+
+static void compare_state(const char* ref_file, const char* sim_file, t_diffs* diffs)
+{
+  /* the header written by d2q9_save_state() */
+  struct
+  {
+    char    magic[8];
+    int32_t nx;
+    int32_t ny;
+    int32_t nspeeds;
+    int32_t float_size;
+  } ref_header, sim_header;
+  float* ref_vals = malloc(sizeof(float) * STATE_CHUNK);
+  float* sim_vals = malloc(sizeof(float) * STATE_CHUNK);
+  FILE*  ref = open_file(ref_file);
+  FILE*  sim = open_file(sim_file);
+  long   nvalues;
+
+  memset(diffs, 0, sizeof(t_diffs));
+
+  if (ref == NULL || sim == NULL || ref_vals == NULL || sim_vals == NULL)
+  {
+    diffs->error = 1;
+  }
+  else if (fread(&ref_header, sizeof(ref_header), 1, ref) != 1 || fread(&sim_header, sizeof(sim_header), 1, sim) != 1
+           || memcmp(ref_header.magic, STATE_MAGIC, 8) || memcmp(sim_header.magic, STATE_MAGIC, 8)
+           || ref_header.float_size != sizeof(float) || sim_header.float_size != sizeof(float))
+  {
+    printf("Not a saved state of this precision\n");
+    diffs->error = 1;
+  }
+  else if (ref_header.nx != sim_header.nx || ref_header.ny != sim_header.ny || ref_header.nspeeds != sim_header.nspeeds)
+  {
+    printf("State files are of different grid sizes\n");
+    diffs->error = 1;
+  }
+  else
+  {
+    nvalues = (long)ref_header.nx * ref_header.ny * ref_header.nspeeds;
+
+    for (long done = 0; done < nvalues && !diffs->error; )
+    {
+      const size_t n = nvalues - done < STATE_CHUNK ? nvalues - done : STATE_CHUNK;
+
+      if (fread(ref_vals, sizeof(float), n, ref) != n || fread(sim_vals, sizeof(float), n, sim) != n)
+      {
+        printf("State file is truncated\n");
+        diffs->error = 1;
+        break;
+      }
+
+      for (size_t vv = 0; vv < n; vv++)
+      {
+        if (add_value(diffs, ref_vals[vv], sim_vals[vv]))
+        {
+          const long cell = (done + vv) / ref_header.nspeeds;
+
+          diffs->jj = cell % ref_header.nx;
+          diffs->ii = cell / ref_header.nx;
+          diffs->kk = (done + vv) % ref_header.nspeeds;
+        }
+      }
+
+      done += n;
+    }
+  }
+
+  free(ref_vals);
+  free(sim_vals);
+  if (ref != NULL) fclose(ref);
+  if (sim != NULL) fclose(sim);
+}
+
+static inline int add_value(t_diffs* diffs, double ref, double sim)
+{
+  const double diff = ref - sim;
+  const double pcnt = 100.0 * (diff / (ref - diff));
+  int          biggest;
+
+  /* as numpy's argmax, the first NaN or else the first largest value */
+  if (diffs->count == 0) biggest = 1;
+  else if (is_nan(diffs->max_pcnt)) biggest = 0;
+  else biggest = is_nan(pcnt) || fabs(pcnt) > fabs(diffs->max_pcnt);
+
+  if (biggest)
+  {
+    diffs->max_index = diffs->count;
+    diffs->max_diff = diff;
+    diffs->max_pcnt = pcnt;
+    diffs->sim_val = sim;
+    diffs->ref_val = ref;
+  }
+
+  diffs->total += fabs(diff);
+  diffs->count++;
+
+  return biggest;
+}
+
+static inline int is_nan(double x)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &x, sizeof(bits));
+
+  return (bits & 0x7ff0000000000000ULL) == 0x7ff0000000000000ULL && (bits & 0x000fffffffffffffULL);
+}
+
+static inline int is_finite(double x)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &x, sizeof(bits));
+
+  return (bits & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL;
+}
+
+static FILE* open_file(const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "could not open file: %s\n", filename);
+    return NULL;
+  }
+
+  setvbuf(fp, NULL, _IOFBF, READ_BUFFER);
+
+  return fp;
+}
+
+static int failed(const t_diffs* diffs, double tolerance)
+{
+  return !is_finite(diffs->max_pcnt) || fabs(diffs->max_pcnt) > tolerance;
+}
+
+static void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s [--tolerance <percent>]\n"
+                  "       --ref-av-vels-file <file> --ref-final-state-file <file>\n"
+                  "       --av-vels-file <file> --final-state-file <file>\n"
+                  "       [--ref-state-file <file> --state-file <file>]\n", exe);
+  exit(EXIT_FAILURE);
+}
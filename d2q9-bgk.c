@@ -1,147 +1,116 @@
 /*
-** Code to implement a d2q9-bgk lattice boltzmann scheme.
-** 'd2' inidates a 2-dimensional grid, and
-** 'q9' indicates 9 velocities per grid cell.
-** 'bgk' refers to the Bhatnagar-Gross-Krook collision step.
+** Command line driver for the d2q9-bgk lattice boltzmann solver.
+** The scheme itself is implemented by libd2q9, see d2q9.c and d2q9.h.
 **
-** The 'speeds' in each cell are numbered as follows:
+** Note the names of the input parameter and obstacle files
+** are passed on the command line, e.g.:
 **
-** 6 2 5
-**  \|/
-** 3-0-1
-**  /|\
-** 7 4 8
+**   d2q9-bgk.exe input.params obstacles.dat
 **
-** A 2D grid:
+** Be sure to adjust the grid dimensions in the parameter file
+** if you choose a different obstacle file.
 **
-**           cols
-**       --- --- ---
-**      | D | E | F |
-** rows  --- --- ---
-**      | A | B | C |
-**       --- --- ---
+** Optional flags may follow the two file names:
 **
-** 'unwrapped' in row major order to give a 1D array:
+**   --perf-counters   collect hardware counters per kernel and thread
+**   --timing          time each kernel and barrier per thread with the TSC
+**   --trace <file>    as --timing, and write sampled iterations as Chrome trace JSON
+**   --trace-every <n> sample every n'th iteration for the trace (default 100)
+**   --ensemble <file> run one simulation per 'accel omega' line of <file>
+**                     together, writing av_vels_<m>.dat and final_state_<m>.dat
+**   --converge <tol>  stop once the average velocity has changed by less than
+**                     tol, relative to its mean, over the last window of steps
+**   --converge-window <n> steps in that window (default 1000)
+**   --converge-l2 <tol> stop once the relative L2 norm of the change in the
+**                     velocity field over one step is below tol
+**   --init-state <file>  start from distributions saved by --save-state
+**   --init-fields <file> start from the equilibrium of the velocity and
+**                     pressure fields in <file>, e.g. a previous final_state.dat
+**   --save-state <file>  save the final distributions
+**   --av-vels <file>  write the average velocities to <file> instead of
+**                     av_vels.dat, or to stdout for -, in which case the
+**                     report goes to stderr; they are written as the
+**                     run goes, see av_vels_writer.c
+**   --pages <policy>  auto (default), small or hugetlb, see d2q9.h
+**   --pitch <n>       store rows n >= nx cells apart; 0 (default) picks a
+**                     padding which avoids 4 KiB aliasing between rows
+**   --tile <n>        store the lattice in tiles of n x n cells instead of
+**                     by rows; 0 (default) for rows
+**   --nt-stores <mode> auto (default), on or off: write the lattice in the
+**                     collision with non-temporal stores; auto uses them
+**                     once the grids are larger than the last level cache
+**   --prefetch <n>    prefetch the rows read by the streaming step n cells
+**                     ahead; 0 (default) for none
+**   --forcing <scheme> row (default) accelerates the second row from the
+**                     top, body applies the same momentum per step as a
+**                     body force on every fluid cell (Guo forcing)
+**   --autotune        time candidate threads, prefetch distances, stores
+**                     and row pitches first and record the fastest in the
+**                     tuning database (see autotune.c)
+**   --tune-db <file>  the tuning database, instead of $D2Q9_TUNING_DB or
+**                     ~/.d2q9-bgk-tuning
+**   --no-tune         ignore the tuning database
+**   --multigrid <levels> start from the solution on levels - 1 successively
+**                     coarser lattices (see multigrid.c)
+**   --reference <file> compare the average velocity of each step with
+**                     <file>, e.g. check/128x128.av_vels.dat, and stop with
+**                     an error at the first one outside the tolerance; a
+**                     longer reference is compared on its first steps
+**   --reference-final <file> also compare the final pressure field with
+**                     <file>, e.g. check/128x128.final_state.dat
+**   --reference-tolerance <pct> the tolerance, as for d2q9-check (default 1)
 **
-**  --- --- --- --- --- ---
-** | A | B | C | D | E | F |
-**  --- --- --- --- --- ---
+** Settings recorded in the tuning database for the grid size, number of
+** threads and cpu are used unless given on the command line.
 **
-** Grid indicies are:
+** When both convergence criteria are given, both have to be met. The output
+** files then cover the iterations actually run.
 **
-**          ny
-**          ^       cols(jj)
-**          |  ----- ----- -----
-**          | | ... | ... | etc |
-**          |  ----- ----- -----
-** rows(ii) | | 1,0 | 1,1 | 1,2 |
-**          |  ----- ----- -----
-**          | | 0,0 | 0,1 | 0,2 |
-**          |  ----- ----- -----
-**          ----------------------> nx
+** or, to run many simulations concurrently on disjoint sets of cores
+** (see batch.c):
 **
-** Note the names of the input parameter and obstacle files
-** are passed on the command line, e.g.:
+**   d2q9-bgk.exe --batch jobs.txt
 **
-**   d2q9-bgk.exe input.params obstacles.dat
+** or to keep lattices and threads warm between jobs sent over a Unix
+** domain socket (see server.c):
 **
-** Be sure to adjust the grid dimensions in the parameter file
-** if you choose a different obstacle file.
+**   d2q9-bgk.exe --serve <socket>
+**   d2q9-bgk.exe --request <socket> 'paramfile obstaclefile [prefix [outputs]]'
 */
 
 #include<stdio.h>
 #include<stdlib.h>
-#include<math.h>
+#include<string.h>
 #include<time.h>
 #include<sys/time.h>
 #include<sys/resource.h>
-#include <xmmintrin.h>
+#include<unistd.h>
 #include <omp.h>
 
-#define NSPEEDS         9
+#include "d2q9.h"
+#include "d2q9-bgk.h"
+#include "instrument.h"
+
 #define FINALSTATEFILE  "final_state.dat"
 #define AVVELSFILE      "av_vels.dat"
-
-/* struct to hold the parameter values */
-typedef struct
-{
-  int    nx;            /* no. of cells in x-direction */
-  int    ny;            /* no. of cells in y-direction */
-  int    maxIters;      /* no. of iterations */
-  int    reynolds_dim;  /* dimension for Reynolds number */
-  float density;       /* density per link */
-  float accel;         /* density redistribution */
-  float omega;         /* relaxation parameter */
-} t_param;
-
-/* struct to hold the 'speed' values */
-typedef struct
-{
-  float speeds[NSPEEDS];
-} t_speed;
-
-/* struct to hold the 'speed' temporary values and calculated derivatives */
-typedef struct
-{
-    float speeds[NSPEEDS];
-    float local_density;
-    float u_x;
-    float u_y;
-} t_speed_temp;
+#define ENSEMBLEFINALSTATEFILE "final_state_%d.dat"
+#define ENSEMBLEAVVELSFILE     "av_vels_%d.dat"
+#define TRACE_RING_EVENTS (1 << 16) /* per-thread events kept for the Chrome trace */
+#define TRACE_EVERY     100
+#define CONVERGE_WINDOW 1000
 
 /*
 ** function prototypes
 */
 
-/* load params, allocate memory, load obstacles & initialise fluid particle densities */
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed_temp** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr);
+/* write the final state; the average velocities are written as the run goes */
+int write_values(const d2q9_sim* sim, const int* obstacles);
 
-/*
-** The main calculation methods.
-** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & rebound_and_collision()
-*/
-void timestep(const t_param params, t_speed* cells, t_speed_temp* tmp_cells, int* obstacles);
-void accelerate_flow(const t_param params, t_speed* cells, int* obstacles);
-void propagate(const t_param params, t_speed* cells, t_speed_temp* tmp_cells);
-void rebound_and_collision(const t_param params, t_speed *cells, t_speed_temp *tmp_cells, int *obstacles);
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels);
+/* run an ensemble of simulations, one per line of ensemblefile */
+int run_ensemble(const t_param params, const int* obstacles, const char* ensemblefile);
 
-/* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed_temp** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr);
-
-/* Sum all the densities in the grid.
-** The total should remain constant from one timestep to the next. */
-float total_density(const t_param params, t_speed* cells);
-
-/* compute average velocity */
-float av_velocity(const t_param params, t_speed* cells, int* obstacles);
-
-/* calculate Reynolds number */
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles);
-
-/* utility functions */
-void die(const char* message, const int line, const char* file);
 void usage(const char* exe);
 
-inline float fast_sqrt(float fIn) {
-  if (fIn == 0) { return 0.0f; }
-  float fOut;
-  _mm_store_ss(&fOut, _mm_mul_ss(_mm_load_ss(&fIn), _mm_rsqrt_ss(_mm_load_ss( &fIn ))));
-  return fOut;
-}
-
-int tot_cells = 0;
-
-/* accelerate_flow() constants: */
-/* weighting factors */
-float accelerate_flow_w1, accelerate_flow_w2;
-/* 2nd row of the grid */
-int accelerate_flow_ii;
-
 /*
 ** main program:
 ** initialise, timestep loop, finalise
@@ -151,18 +120,61 @@ int main(int argc, char* argv[])
   char*    paramfile = NULL;    /* name of the input parameter file */
   char*    obstaclefile = NULL; /* name of a the input obstacle file */
   t_param  params;              /* struct to hold parameter values */
-  t_speed* cells     = NULL;    /* grid containing fluid densities */
-  t_speed_temp* tmp_cells = NULL;    /* scratch space */
+  d2q9_sim* sim      = NULL;    /* the simulation */
   int*     obstacles = NULL;    /* grid indicating which cells are blocked */
-  float* av_vels   = NULL;     /* a record of the av. velocity computed for each timestep */
+  float* av_vels   = NULL;     /* the av. velocity of the last converge.window timesteps */
+  t_av_vels_writer* av_vels_out = NULL; /* writes the av. velocity of each timestep */
+  const char* avvelsfile = AVVELSFILE; /* where to */
   struct timeval timstr;        /* structure to hold elapsed time */
   struct rusage ru;             /* structure to hold CPU time--system and user */
   double tic, toc;              /* floating point numbers to calculate elapsed wallclock time */
   double usrtim;                /* floating point number to record elapsed user CPU time */
   double systim;                /* floating point number to record elapsed system CPU time */
+  int    use_perf_counters = 0; /* collect hardware performance counters */
+  int    use_timing = 0;        /* time each phase with the TSC */
+  char*  tracefile = NULL;      /* Chrome trace output, if wanted */
+  int    trace_every = TRACE_EVERY; /* iteration sampling interval of the trace */
+  char*  ensemblefile = NULL;   /* accel/omega of each ensemble member, if wanted */
+  t_converge converge = { 0.0f, CONVERGE_WINDOW, 0.0f }; /* early stopping, if wanted */
+  int    iterations;            /* timesteps actually run */
+  int    stopped = 0;           /* non-zero if the run converged */
+  char*  initstatefile = NULL;  /* distributions to warm start from, if wanted */
+  char*  initfieldsfile = NULL; /* macroscopic fields to warm start from, if wanted */
+  char*  savestatefile = NULL;  /* where to save the final distributions, if wanted */
+  int    multigrid_levels = 1;  /* lattices in the coarse-to-fine hierarchy */
+  int    coarse_steps = 0;      /* steps taken on the coarse lattices */
+  int    prefetch = -1;         /* software prefetch distance in cells, if given */
+  int    nt_stores_given = 0;   /* --nt-stores was given */
+  int    pitch_given = 0;       /* --pitch was given */
+  int    tile_given = 0;        /* --tile was given */
+  int    run_autotune = 0;      /* tune before the run */
+  int    use_tuning = 1;        /* apply settings from the tuning database */
+  const char* tuningdb = NULL;  /* the tuning database, if not the default */
+  t_tuning tuning;              /* settings from the tuning database */
+  int    tuned = 0;             /* non-zero if tuning holds settings to use */
+  char*  referencefile = NULL;  /* reference av_vels to validate against, if wanted */
+  char*  referencefinalfile = NULL; /* and the reference final state */
+  double reference_tolerance = REFERENCE_TOLERANCE; /* % */
+  t_reference reference;        /* the reference results */
+  int    failed_step = -1;      /* the first step outside the tolerance, if any */
+  d2q9_options options;         /* creation time settings of the simulation */
+
+  d2q9_default_options(&options);
 
   /* parse the command line */
-  if (argc != 3)
+  if (argc == 3 && !strcmp(argv[1], "--batch"))
+  {
+    return run_batch(argv[2]);
+  }
+  else if (argc == 3 && !strcmp(argv[1], "--serve"))
+  {
+    return run_server(argv[2]);
+  }
+  else if (argc == 4 && !strcmp(argv[1], "--request"))
+  {
+    return server_request(argv[2], argv[3]);
+  }
+  else if (argc < 3)
   {
     usage(argv[0]);
   }
@@ -172,35 +184,296 @@ int main(int argc, char* argv[])
     obstaclefile = argv[2];
   }
 
-  /* initialise our data structures and load values from file */
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
+  for (int aa = 3; aa < argc; aa++)
+  {
+    if (!strcmp(argv[aa], "--perf-counters"))
+    {
+      use_perf_counters = 1;
+    }
+    else if (!strcmp(argv[aa], "--timing"))
+    {
+      use_timing = 1;
+    }
+    else if (!strcmp(argv[aa], "--trace") && aa + 1 < argc)
+    {
+      use_timing = 1;
+      tracefile = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--trace-every") && aa + 1 < argc)
+    {
+      trace_every = atoi(argv[++aa]);
+    }
+    else if (!strcmp(argv[aa], "--ensemble") && aa + 1 < argc)
+    {
+      ensemblefile = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--converge") && aa + 1 < argc)
+    {
+      converge.tol = atof(argv[++aa]);
+    }
+    else if (!strcmp(argv[aa], "--converge-window") && aa + 1 < argc)
+    {
+      converge.window = atoi(argv[++aa]);
+    }
+    else if (!strcmp(argv[aa], "--converge-l2") && aa + 1 < argc)
+    {
+      converge.l2 = atof(argv[++aa]);
+    }
+    else if (!strcmp(argv[aa], "--init-state") && aa + 1 < argc)
+    {
+      initstatefile = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--init-fields") && aa + 1 < argc)
+    {
+      initfieldsfile = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--save-state") && aa + 1 < argc)
+    {
+      savestatefile = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--av-vels") && aa + 1 < argc)
+    {
+      avvelsfile = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--pages") && aa + 1 < argc)
+    {
+      aa++;
+      if (!strcmp(argv[aa], "auto")) options.pages = D2Q9_PAGES_AUTO;
+      else if (!strcmp(argv[aa], "small")) options.pages = D2Q9_PAGES_SMALL;
+      else if (!strcmp(argv[aa], "hugetlb")) options.pages = D2Q9_PAGES_HUGETLB;
+      else usage(argv[0]);
+    }
+    else if (!strcmp(argv[aa], "--pitch") && aa + 1 < argc)
+    {
+      options.row_pitch = atoi(argv[++aa]);
+      pitch_given = 1;
+    }
+    else if (!strcmp(argv[aa], "--tile") && aa + 1 < argc)
+    {
+      options.tile = atoi(argv[++aa]);
+      tile_given = 1;
+    }
+    else if (!strcmp(argv[aa], "--nt-stores") && aa + 1 < argc)
+    {
+      aa++;
+      if (!strcmp(argv[aa], "auto")) options.streaming_stores = D2Q9_STREAM_AUTO;
+      else if (!strcmp(argv[aa], "on")) options.streaming_stores = D2Q9_STREAM_ON;
+      else if (!strcmp(argv[aa], "off")) options.streaming_stores = D2Q9_STREAM_OFF;
+      else usage(argv[0]);
+      nt_stores_given = 1;
+    }
+    else if (!strcmp(argv[aa], "--prefetch") && aa + 1 < argc)
+    {
+      prefetch = atoi(argv[++aa]);
+    }
+    else if (!strcmp(argv[aa], "--forcing") && aa + 1 < argc)
+    {
+      aa++;
+      if (!strcmp(argv[aa], "row")) options.forcing = D2Q9_FORCE_ROW;
+      else if (!strcmp(argv[aa], "body")) options.forcing = D2Q9_FORCE_BODY;
+      else usage(argv[0]);
+    }
+    else if (!strcmp(argv[aa], "--autotune"))
+    {
+      run_autotune = 1;
+    }
+    else if (!strcmp(argv[aa], "--tune-db") && aa + 1 < argc)
+    {
+      tuningdb = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--no-tune"))
+    {
+      use_tuning = 0;
+    }
+    else if (!strcmp(argv[aa], "--multigrid") && aa + 1 < argc)
+    {
+      multigrid_levels = atoi(argv[++aa]);
+    }
+    else if (!strcmp(argv[aa], "--reference") && aa + 1 < argc)
+    {
+      referencefile = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--reference-final") && aa + 1 < argc)
+    {
+      referencefinalfile = argv[++aa];
+    }
+    else if (!strcmp(argv[aa], "--reference-tolerance") && aa + 1 < argc)
+    {
+      reference_tolerance = atof(argv[++aa]);
+    }
+    else
+    {
+      usage(argv[0]);
+    }
+  }
+
+  /* with --av-vels -, stdout carries only the average velocities: the
+  ** writer keeps its own copy of stdout, and everything else printed from
+  ** here on, including the tuning and multigrid output, goes to stderr */
+  if (!strcmp(avvelsfile, "-"))
+  {
+    av_vels_out = av_vels_writer_open(avvelsfile);
 
-  /* iterate for maxIters timesteps */
-  gettimeofday(&timstr, NULL);
-  tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+    if (av_vels_out == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+      die("could not open the av_vels output", __LINE__, __FILE__);
+  }
 
-  for (int ii = 0; ii < params.nx * params.ny; ii++) {
-    if (!obstacles[ii]) {
-      tot_cells++;
-    }
+  /* load values from file and initialise the simulation */
+  if (d2q9_read_params(paramfile, &params) != EXIT_SUCCESS)
+    die("could not load parameters", __LINE__, __FILE__);
+
+  obstacles = malloc(sizeof(int) * (params.ny * params.nx));
+
+  if (obstacles == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+
+  if (d2q9_read_obstacles(obstaclefile, &params, obstacles) != EXIT_SUCCESS)
+    die("could not load obstacles", __LINE__, __FILE__);
+
+  if (run_autotune && ensemblefile != NULL) die("--autotune is only supported for single runs", __LINE__, __FILE__);
+
+  /* before the counters and the trace, which should only see the real run */
+  if (tuningdb == NULL) tuningdb = tuning_db_path();
+
+  if (run_autotune)
+  {
+    if (autotune(tuningdb, &params, obstacles, &tuning) != EXIT_SUCCESS)
+      fprintf(stderr, "could not record the tuned settings\n");
+    tuned = 1;
+  }
+  else if (use_tuning && ensemblefile == NULL)
+  {
+    tuned = tuning_lookup(tuningdb, &params, &tuning);
+  }
+
+  if (tuned)
+  {
+    if (!nt_stores_given) options.streaming_stores = tuning.streaming_stores;
+    if (!pitch_given && !tile_given) options.tile = tuning.tile;
+    if (!pitch_given && options.tile == 0) options.row_pitch = tuning.row_pitch;
+    if (prefetch < 0) prefetch = tuning.prefetch;
   }
 
-  /* set up accelerate_flow() constants */
-  accelerate_flow_w1 = params.density * params.accel / 9.0f;
-  accelerate_flow_w2 = params.density * params.accel / 36.0f;
-  accelerate_flow_ii = params.ny - 2;
+  if (use_perf_counters) perf_counters_init();
+  if (use_timing) trace_init(TRACE_RING_EVENTS, trace_every);
+
+  if (multigrid_levels > 1 && (initstatefile != NULL || initfieldsfile != NULL))
+    die("--multigrid cannot be combined with another initial state", __LINE__, __FILE__);
+
+  if (converge.window < 2) die("--converge-window must be at least 2", __LINE__, __FILE__);
+
+  if (referencefinalfile != NULL && referencefile == NULL)
+    die("--reference-final needs --reference", __LINE__, __FILE__);
+
+  /* the references are complete runs of maxIters steps from the usual start */
+  if (referencefile != NULL)
+  {
+    if (ensemblefile != NULL) die("reference checks are only supported for single runs", __LINE__, __FILE__);
+    if (converge.tol > 0.0f || converge.l2 > 0.0f)
+      die("--reference cannot be combined with convergence criteria", __LINE__, __FILE__);
+    if (initstatefile != NULL || initfieldsfile != NULL || multigrid_levels > 1)
+      die("--reference cannot be combined with another initial state", __LINE__, __FILE__);
+    if (!(reference_tolerance >= 0.0)) die("--reference-tolerance must not be negative", __LINE__, __FILE__);
+
+    if (reference_read(&reference, referencefile, referencefinalfile, params) != EXIT_SUCCESS)
+      die("could not load reference results", __LINE__, __FILE__);
+
+    reference.tolerance = reference_tolerance;
+  }
+
+  if (ensemblefile != NULL)
+  {
+    if (converge.tol > 0.0f || converge.l2 > 0.0f)
+      die("convergence criteria are only supported for single runs", __LINE__, __FILE__);
+    if (initstatefile != NULL || initfieldsfile != NULL || savestatefile != NULL)
+      die("saved states are only supported for single runs", __LINE__, __FILE__);
+    if (multigrid_levels > 1)
+      die("multigrid initialisation is only supported for single runs", __LINE__, __FILE__);
+    if (options.forcing != D2Q9_FORCE_ROW)
+      die("body forcing is only supported for single runs", __LINE__, __FILE__);
+    if (options.tile != 0)
+      die("tiled storage is only supported for single runs", __LINE__, __FILE__);
+    if (strcmp(avvelsfile, AVVELSFILE))
+      die("--av-vels is only supported for single runs", __LINE__, __FILE__);
+
+    run_ensemble(params, obstacles, ensemblefile);
+    if (tracefile != NULL) trace_write_chrome(tracefile);
+    trace_finalise();
+    free(obstacles);
+    return EXIT_SUCCESS;
+  }
+
+  /*
+  ** allocate space to hold the avarage velocities of the convergence
+  ** window; the others only go to the output file
+  */
+  av_vels = (float*)malloc(sizeof(float) * converge.window);
+
+  if (av_vels == NULL) die("cannot allocate memory for av_vels", __LINE__, __FILE__);
+
+  sim = d2q9_create_with_options(&params, obstacles, &options);
+
+  if (sim == NULL) die("could not create simulation", __LINE__, __FILE__);
+
+  d2q9_set_prefetch(sim, prefetch);
+  if (tuned) d2q9_set_threads(sim, tuning.nthreads);
+
+  if (initstatefile != NULL && d2q9_load_state(sim, initstatefile) != EXIT_SUCCESS)
+    die("could not load initial state", __LINE__, __FILE__);
+
+  if (initfieldsfile != NULL)
+  {
+    const int ncells = params.ny * params.nx;
+    float* fields = malloc(sizeof(float) * 3 * ncells); /* u_x, u_y and pressure */
+
+    if (fields == NULL) die("cannot allocate memory for initial fields", __LINE__, __FILE__);
+
+    read_final_state(initfieldsfile, params, fields, fields + ncells, fields + 2 * ncells);
+    d2q9_set_fields(sim, fields, fields + ncells, fields + 2 * ncells);
+    free(fields);
+  }
+
+  if (converge.l2 > 0.0f && d2q9_track_velocity_change(sim, 1) != EXIT_SUCCESS)
+    die("could not track the velocity change", __LINE__, __FILE__);
+
+  if (av_vels_out == NULL) av_vels_out = av_vels_writer_open(avvelsfile);
+
+  if (av_vels_out == NULL) die("could not open the av_vels output", __LINE__, __FILE__);
+
+  /* iterate for maxIters timesteps, or until converged */
+  gettimeofday(&timstr, NULL);
+  tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+
+  /* part of the time to the steady state */
+  if (multigrid_levels > 1) coarse_steps = multigrid_init(sim, obstacles, multigrid_levels, &converge);
 
   for (int tt = 0; tt < params.maxIters; tt++)
   {
-    timestep(params, cells, tmp_cells, obstacles);
-    av_vels[tt] = av_velocity(params, cells, obstacles);
+    float* av_vel = &av_vels[tt % converge.window];
+
+    if (trace_enabled) trace_iteration(tt);
+    d2q9_step(sim, 1, av_vel);
+    av_vels_writer_add(av_vels_out, *av_vel);
 #ifdef DEBUG
     printf("==timestep: %d==\n", tt);
-    printf("av velocity: %.12E\n", av_vels[tt]);
-    printf("tot density: %.12E\n", total_density(params, cells));
+    printf("av velocity: %.12E\n", *av_vel);
+    printf("tot density: %.12E\n", d2q9_total_density(sim));
 #endif
+
+    if (converged(&converge, sim, av_vels, tt))
+    {
+      stopped = 1;
+      break;
+    }
+
+    if (referencefile != NULL && !reference_check_step(&reference, tt, *av_vel))
+    {
+      failed_step = tt;
+      break;
+    }
   }
 
+  iterations = d2q9_iterations(sim);
+
   gettimeofday(&timstr, NULL);
   toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
   getrusage(RUSAGE_SELF, &ru);
@@ -211,495 +484,316 @@ int main(int argc, char* argv[])
 
   /* write final values and free memory */
   printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, cells, obstacles));
+  printf("Reynolds number:\t\t%.12E\n", d2q9_reynolds(sim));
+  if (converge.tol > 0.0f || converge.l2 > 0.0f)
+  {
+    printf("%s at iteration:\t\t%d\n", stopped ? "Converged" : "Not converged", iterations);
+  }
+  if (multigrid_levels > 1)
+  {
+    printf("Coarse level steps:\t\t%d\n", coarse_steps);
+  }
+  if (failed_step >= 0)
+  {
+    printf("Reference check failed at:\t%d\n", failed_step);
+  }
   printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
   printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
   printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
   printf("Num, max num of threads:\t%d\t%d\n", omp_get_num_threads(), omp_get_max_threads());
-  write_values(params, cells, obstacles, av_vels);
-  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  printf("Lattice page size:\t\t%ld (kB)\n", d2q9_page_size(sim) / 1024);
+  printf("Lattice row pitch:\t\t%d\n", d2q9_row_pitch(sim));
+  if (d2q9_tile(sim)) printf("Lattice tile:\t\t\t%dx%d\n", d2q9_tile(sim), d2q9_tile(sim));
+  if (d2q9_body_force(sim) != 0.0f) printf("Body force:\t\t\t%.6E\n", d2q9_body_force(sim));
+  printf("Streaming stores:\t\t%s\n", d2q9_streaming_stores(sim) ? "on" : "off");
+  printf("Prefetch distance:\t\t%d\n", d2q9_prefetch(sim));
+  printf("Kernel threads:\t\t\t%d%s\n", d2q9_threads(sim), tuned ? " (tuned)" : "");
+  perf_counters_report(stdout);
+  perf_counters_finalise();
+  trace_report(stdout, iterations);
+  if (tracefile != NULL) trace_write_chrome(tracefile);
+  trace_finalise();
+  write_values(sim, obstacles);
+
+  if (av_vels_writer_close(av_vels_out) != EXIT_SUCCESS) die("could not write the av_vels output", __LINE__, __FILE__);
+
+  if (savestatefile != NULL && d2q9_save_state(sim, savestatefile) != EXIT_SUCCESS)
+    die("could not save final state", __LINE__, __FILE__);
+
+  /* the final state is only compared after a complete run */
+  if (referencefile != NULL)
+  {
+    if (failed_step < 0 && !reference_check_final(&reference, sim)) failed_step = iterations;
 
-  return EXIT_SUCCESS;
-}
+    printf("Reference check %s\n", failed_step < 0 ? "passed" : "failed");
+    reference_free(&reference);
+  }
 
-void timestep(const t_param params, t_speed* cells, t_speed_temp* tmp_cells, int* obstacles)
-{
-  accelerate_flow(params, cells, obstacles);
-  propagate(params, cells, tmp_cells);
-  rebound_and_collision(params, cells, tmp_cells, obstacles);
+  d2q9_destroy(sim);
+  free(obstacles);
+  free(av_vels);
+
+  return failed_step < 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-void accelerate_flow(const t_param params, t_speed* cells, int* obstacles)
+int write_values(const d2q9_sim* sim, const int* obstacles)
 {
+  const t_param params = *d2q9_params(sim);
+  float* u_x;                   /* x-component of velocity in each grid cell */
+  float* u_y;                   /* y-component of velocity in each grid cell */
+  float* u;                     /* norm--root of summed squares--of u_x and u_y */
+  float* pressure;              /* fluid pressure in each grid cell */
 
-#pragma omp parallel for
-  for (int jj = 0; jj < params.nx; jj++)
-  {
-    /* if the cell is not occupied and
-    ** we don't send a negative density */
-    if (!obstacles[accelerate_flow_ii * params.nx + jj]
-        && (cells[accelerate_flow_ii * params.nx + jj].speeds[3] - accelerate_flow_w1) > 0.0
-        && (cells[accelerate_flow_ii * params.nx + jj].speeds[6] - accelerate_flow_w2) > 0.0
-        && (cells[accelerate_flow_ii * params.nx + jj].speeds[7] - accelerate_flow_w2) > 0.0)
-    {
-      /* increase 'east-side' densities */
-      cells[accelerate_flow_ii * params.nx + jj].speeds[1] += accelerate_flow_w1;
-      cells[accelerate_flow_ii * params.nx + jj].speeds[5] += accelerate_flow_w2;
-      cells[accelerate_flow_ii * params.nx + jj].speeds[8] += accelerate_flow_w2;
-      /* decrease 'west-side' densities */
-      cells[accelerate_flow_ii * params.nx + jj].speeds[3] -= accelerate_flow_w1;
-      cells[accelerate_flow_ii * params.nx + jj].speeds[6] -= accelerate_flow_w2;
-      cells[accelerate_flow_ii * params.nx + jj].speeds[7] -= accelerate_flow_w2;
-    }
-  }
-}
+  u_x = malloc(sizeof(float) * 4 * (params.ny * params.nx));
 
-void propagate(const t_param params, t_speed* cells, t_speed_temp* tmp_cells)
-{
-  /* loop over _all_ cells */
-#pragma omp parallel for
-  for (int ii = 0; ii < params.ny; ii++)
-  {
-    for (int jj = 0; jj < params.nx; jj++)
-    {
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      int y_n = (ii + 1) % params.ny;
-      int x_e = (jj + 1) % params.nx;
-      int y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
-      int x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
-      /* propagate densities to neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */
-      tmp_cells[ii * params.nx + jj].speeds[0] = cells[ii * params.nx + jj].speeds[0];
-      tmp_cells[ii * params.nx + jj].speeds[1] = cells[ii * params.nx + x_w].speeds[1];
-      tmp_cells[ii * params.nx + jj].speeds[2] = cells[y_s * params.nx + jj].speeds[2];
-      tmp_cells[ii * params.nx + jj].speeds[3] = cells[ii * params.nx + x_e].speeds[3];
-      tmp_cells[ii * params.nx + jj].speeds[4] = cells[y_n * params.nx + jj].speeds[4];
-      tmp_cells[ii * params.nx + jj].speeds[5] = cells[y_s * params.nx + x_w].speeds[5];
-      tmp_cells[ii * params.nx + jj].speeds[6] = cells[y_s * params.nx + x_e].speeds[6];
-      tmp_cells[ii * params.nx + jj].speeds[7] = cells[y_n * params.nx + x_e].speeds[7];
-      tmp_cells[ii * params.nx + jj].speeds[8] = cells[y_n * params.nx + x_w].speeds[8];
-
-      /* compute local density total */
-      tmp_cells[ii * params.nx + jj].local_density = tmp_cells[ii * params.nx + jj].speeds[0]
-                                                 + tmp_cells[ii * params.nx + jj].speeds[1]
-                                                 + tmp_cells[ii * params.nx + jj].speeds[2]
-                                                 + tmp_cells[ii * params.nx + jj].speeds[3]
-                                                 + tmp_cells[ii * params.nx + jj].speeds[4]
-                                                 + tmp_cells[ii * params.nx + jj].speeds[5]
-                                                 + tmp_cells[ii * params.nx + jj].speeds[6]
-                                                 + tmp_cells[ii * params.nx + jj].speeds[7]
-                                                 + tmp_cells[ii * params.nx + jj].speeds[8];
-
-      /* compute x velocity component */
-      tmp_cells[ii * params.nx + jj].u_x = (tmp_cells[ii * params.nx + jj].speeds[1]
-                                                   + tmp_cells[ii * params.nx + jj].speeds[5]
-                                                   + tmp_cells[ii * params.nx + jj].speeds[8]
-                                                   - (tmp_cells[ii * params.nx + jj].speeds[3]
-                                                      + tmp_cells[ii * params.nx + jj].speeds[6]
-                                                      + tmp_cells[ii * params.nx + jj].speeds[7]))
-                                                  / tmp_cells[ii * params.nx + jj].local_density;
-
-      /* compute y velocity component */
-      tmp_cells[ii * params.nx + jj].u_y = (tmp_cells[ii * params.nx + jj].speeds[2]
-                                                   + tmp_cells[ii * params.nx + jj].speeds[5]
-                                                   + tmp_cells[ii * params.nx + jj].speeds[6]
-                                                   - (tmp_cells[ii * params.nx + jj].speeds[4]
-                                                      + tmp_cells[ii * params.nx + jj].speeds[7]
-                                                      + tmp_cells[ii * params.nx + jj].speeds[8]))
-                                                  / tmp_cells[ii * params.nx + jj].local_density;
-    }
-  }
+  if (u_x == NULL) die("cannot allocate memory for output fields", __LINE__, __FILE__);
+
+  u_y = u_x + params.ny * params.nx;
+  u = u_y + params.ny * params.nx;
+  pressure = u + params.ny * params.nx;
+
+  d2q9_get_fields(sim, u_x, u_y, u, pressure);
+  if (write_final_state(FINALSTATEFILE, params, obstacles, u_x, u_y, u, pressure) != EXIT_SUCCESS)
+    die("could not write final state", __LINE__, __FILE__);
+  free(u_x);
+
+  return EXIT_SUCCESS;
 }
 
-void rebound_and_collision(const t_param params, t_speed *cells, t_speed_temp *tmp_cells, int *obstacles)
+int write_final_state(const char* filename, const t_param params, const int* obstacles,
+                      const float* u_x, const float* u_y, const float* u, const float* pressure)
 {
-  static const float w0 = 4.0f / 9.0f;  /* weighting factor */
-  static const float w1 = 1.0f / 9.0f;  /* weighting factor */
-  static const float w2 = 1.0f / 36.0f; /* weighting factor */
-
-  /* loop over the cells in the grid
-  ** NB the collision step is called after
-  ** the propagate step and so values of interest
-  ** are in the scratch-space grid */
-#pragma omp parallel for
-  for (int ii = 0; ii < params.ny; ii++)
+  FILE* fp;                     /* file pointer */
+
+  fp = fopen(filename, "w");
+
+  if (fp == NULL)
   {
-    for (int jj = 0; jj < params.nx; jj++)
-    {
-      /* don't consider occupied cells */
-      if (!obstacles[ii * params.nx + jj])
-      {
-        /* equilibrium densities */
-        float d_equ[NSPEEDS];
-        /* zero velocity density: weight w0 */
-        d_equ[0] = w0 * tmp_cells[ii * params.nx + jj].local_density * (1.0f - (tmp_cells[ii * params.nx + jj].u_x * tmp_cells[ii * params.nx + jj].u_x + tmp_cells[ii * params.nx + jj].u_y * tmp_cells[ii * params.nx + jj].u_y) * 1.5f);
-        /* axis speeds: weight w1 */
-        d_equ[1] = w1 * tmp_cells[ii * params.nx + jj].local_density * (tmp_cells[ii * params.nx + jj].u_x * (3.0f * tmp_cells[ii * params.nx + jj].u_x + 3.0f) - 1.5f * tmp_cells[ii * params.nx + jj].u_y * tmp_cells[ii * params.nx + jj].u_y + 1.0f);
-        d_equ[2] = w1 * tmp_cells[ii * params.nx + jj].local_density * (-1.5f * tmp_cells[ii * params.nx + jj].u_x * tmp_cells[ii * params.nx + jj].u_x + tmp_cells[ii * params.nx + jj].u_y * (3.0f * tmp_cells[ii * params.nx + jj].u_y + 3.0f) + 1.0f);
-        d_equ[3] = w1 * tmp_cells[ii * params.nx + jj].local_density * (tmp_cells[ii * params.nx + jj].u_x * (3.0f * tmp_cells[ii * params.nx + jj].u_x - 3.0f) - 1.5f * tmp_cells[ii * params.nx + jj].u_y * tmp_cells[ii * params.nx + jj].u_y + 1.0f);
-        d_equ[4] = w1 * tmp_cells[ii * params.nx + jj].local_density * (-1.5f * tmp_cells[ii * params.nx + jj].u_x * tmp_cells[ii * params.nx + jj].u_x + tmp_cells[ii * params.nx + jj].u_y * (3.0f * tmp_cells[ii * params.nx + jj].u_y - 3.0f) + 1.0f);
-        /* diagonal speeds: weight w2 */
-        d_equ[5] = w2 * tmp_cells[ii * params.nx + jj].local_density * (tmp_cells[ii * params.nx + jj].u_x * (3.0f * tmp_cells[ii * params.nx + jj].u_x + 9.0f * tmp_cells[ii * params.nx + jj].u_y + 3.0f) + tmp_cells[ii * params.nx + jj].u_y * (3.0f * tmp_cells[ii * params.nx + jj].u_y + 3.0f) + 1.0f);
-        d_equ[6] = w2 * tmp_cells[ii * params.nx + jj].local_density * (tmp_cells[ii * params.nx + jj].u_y * (-9.0f * tmp_cells[ii * params.nx + jj].u_x + 3.0f * tmp_cells[ii * params.nx + jj].u_y + 3.0f) + tmp_cells[ii * params.nx + jj].u_x * (3.0f * tmp_cells[ii * params.nx + jj].u_x - 3.0f) + 1.0f);
-        d_equ[7] = w2 * tmp_cells[ii * params.nx + jj].local_density * (tmp_cells[ii * params.nx + jj].u_x * (3.0f * tmp_cells[ii * params.nx + jj].u_x + 9.0f * tmp_cells[ii * params.nx + jj].u_y - 3.0f) + tmp_cells[ii * params.nx + jj].u_y * (3.0f * tmp_cells[ii * params.nx + jj].u_y - 3.0f) + 1.0f);
-        d_equ[8] = w2 * tmp_cells[ii * params.nx + jj].local_density * (tmp_cells[ii * params.nx + jj].u_y * (-9.0f * tmp_cells[ii * params.nx + jj].u_x + 3.0f * tmp_cells[ii * params.nx + jj].u_y - 3.0f) + tmp_cells[ii * params.nx + jj].u_x * (3.0f * tmp_cells[ii * params.nx + jj].u_x + 3.0f) + 1.0f);
-
-        /* relaxation step */
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          cells[ii * params.nx + jj].speeds[kk] = tmp_cells[ii * params.nx + jj].speeds[kk]
-                                                  + params.omega
-                                                  * (d_equ[kk] - tmp_cells[ii * params.nx + jj].speeds[kk]);
-        }
-      } else {
-        /* called after propagate, so taking values from scratch space
-        ** mirroring, and writing into main grid */
-        cells[ii * params.nx + jj].speeds[1] = tmp_cells[ii * params.nx + jj].speeds[3];
-        cells[ii * params.nx + jj].speeds[2] = tmp_cells[ii * params.nx + jj].speeds[4];
-        cells[ii * params.nx + jj].speeds[3] = tmp_cells[ii * params.nx + jj].speeds[1];
-        cells[ii * params.nx + jj].speeds[4] = tmp_cells[ii * params.nx + jj].speeds[2];
-        cells[ii * params.nx + jj].speeds[5] = tmp_cells[ii * params.nx + jj].speeds[7];
-        cells[ii * params.nx + jj].speeds[6] = tmp_cells[ii * params.nx + jj].speeds[8];
-        cells[ii * params.nx + jj].speeds[7] = tmp_cells[ii * params.nx + jj].speeds[5];
-        cells[ii * params.nx + jj].speeds[8] = tmp_cells[ii * params.nx + jj].speeds[6];
-      }
-    }
+    fprintf(stderr, "could not open output file: %s\n", filename);
+    return EXIT_FAILURE;
   }
-}
-
-float av_velocity(const t_param params, t_speed* cells, int* obstacles)
-{
-  float tot_u;          /* accumulated magnitudes of velocity for each cell */
 
-  /* initialise */
-  tot_u = 0.0;
-#pragma omp parallel for reduction(+:tot_u)
-  /* loop over all non-blocked cells */
   for (int ii = 0; ii < params.ny; ii++)
   {
     for (int jj = 0; jj < params.nx; jj++)
     {
-      /* ignore occupied cells */
-      if (!obstacles[ii * params.nx + jj])
-      {
-        /* local density total */
-        float local_density = 0.0f;
-#pragma omp simd reduction(+:local_density)
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells[ii * params.nx + jj].speeds[kk];
-        }
-
-        /* x-component of velocity */
-        float u_x = (cells[ii * params.nx + jj].speeds[1]
-                      + cells[ii * params.nx + jj].speeds[5]
-                      + cells[ii * params.nx + jj].speeds[8]
-                      - (cells[ii * params.nx + jj].speeds[3]
-                         + cells[ii * params.nx + jj].speeds[6]
-                         + cells[ii * params.nx + jj].speeds[7]))
-                     / local_density;
-        /* compute y velocity component */
-        float u_y = (cells[ii * params.nx + jj].speeds[2]
-                      + cells[ii * params.nx + jj].speeds[5]
-                      + cells[ii * params.nx + jj].speeds[6]
-                      - (cells[ii * params.nx + jj].speeds[4]
-                         + cells[ii * params.nx + jj].speeds[7]
-                         + cells[ii * params.nx + jj].speeds[8]))
-                     / local_density;
-        /* accumulate the norm of x- and y- velocity components */
-        tot_u += fast_sqrt((float) ((u_x * u_x) + (u_y * u_y)));
-      }
+      const int cell = ii * params.nx + jj;
+
+      /* write to file */
+      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", jj, ii, u_x[cell], u_y[cell], u[cell], pressure[cell], obstacles[cell]);
     }
   }
 
-  return tot_u / (float)tot_cells;
+  fclose(fp);
+
+  return EXIT_SUCCESS;
 }
 
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed_temp** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr)
+int read_final_state(const char* filename, const t_param params, float* u_x, float* u_y, float* pressure)
 {
-  char   message[1024];  /* message buffer */
-  FILE*   fp;            /* file pointer */
-  int    xx, yy;         /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
-  int    retval;         /* to hold return value for checking */
+  char   line[1024];            /* one line of the file */
+  FILE*  fp;                    /* file pointer */
+  int    ncells = 0;            /* lines read */
 
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
+  fp = fopen(filename, "r");
 
   if (fp == NULL)
   {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
-    die(message, __LINE__, __FILE__);
+    sprintf(line, "could not open final state file: %s", filename);
+    die(line, __LINE__, __FILE__);
   }
 
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
-
-  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->ny));
-
-  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->maxIters));
-
-  if (retval != 1) die("could not read param file: maxIters", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
-
-  if (retval != 1) die("could not read param file: reynolds_dim", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->density));
-
-  if (retval != 1) die("could not read param file: density", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->accel));
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    int   jj, ii, blocked;
+    float cell_u_x, cell_u_y, cell_u, cell_pressure;
 
-  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
+    if (sscanf(line, "%d %d %E %E %E %E %d", &jj, &ii, &cell_u_x, &cell_u_y, &cell_u, &cell_pressure, &blocked) != 7)
+      die("expected 'x y u_x u_y u pressure obstacle' per line in final state file", __LINE__, __FILE__);
 
-  retval = fscanf(fp, "%f\n", &(params->omega));
+    if (ii < 0 || ii > params.ny - 1 || jj < 0 || jj > params.nx - 1)
+      die("final state cell is out of the parameter file grid", __LINE__, __FILE__);
 
-  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
+    u_x[ii * params.nx + jj] = cell_u_x;
+    u_y[ii * params.nx + jj] = cell_u_y;
+    pressure[ii * params.nx + jj] = cell_pressure;
+    ncells++;
+  }
 
-  /* and close up the file */
   fclose(fp);
 
-  /*
-  ** Allocate memory.
-  **
-  ** Remember C is pass-by-value, so we need to
-  ** pass pointers into the initialise function.
-  **
-  ** NB we are allocating a 1D array, so that the
-  ** memory will be contiguous.  We still want to
-  ** index this memory as if it were a (row major
-  ** ordered) 2D array, however.  We will perform
-  ** some arithmetic using the row and column
-  ** coordinates, inside the square brackets, when
-  ** we want to access elements of this array.
-  **
-  ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
-  */
-
-  /* main grid */
-  *cells_ptr = (t_speed*)malloc(sizeof(t_speed) * (params->ny * params->nx));
-
-  if (*cells_ptr == NULL) die("cannot allocate memory for cells", __LINE__, __FILE__);
+  if (ncells != params.nx * params.ny) die("final state file does not cover the grid", __LINE__, __FILE__);
 
-  /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = (t_speed_temp*)malloc(sizeof(t_speed_temp) * (params->ny * params->nx));
-
-  if (*tmp_cells_ptr == NULL) die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
-
-  /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
+  return EXIT_SUCCESS;
+}
 
-  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+/* av_vels[ii * stride] is the average velocity after step ii */
+int write_av_vels(const char* filename, const float* av_vels, int nsteps, int stride)
+{
+  FILE* fp;                     /* file pointer */
 
-  /* initialise densities */
-  float w0 = params->density * 4.0f / 9.0f;
-  float w1 = params->density      / 9.0f;
-  float w2 = params->density      / 36.0f;
+  fp = fopen(filename, "w");
 
-  for (int ii = 0; ii < params->ny; ii++)
+  if (fp == NULL)
   {
-    for (int jj = 0; jj < params->nx; jj++)
-    {
-      /* centre */
-      (*cells_ptr)[ii * params->nx + jj].speeds[0] = w0;
-      /* axis directions */
-      (*cells_ptr)[ii * params->nx + jj].speeds[1] = w1;
-      (*cells_ptr)[ii * params->nx + jj].speeds[2] = w1;
-      (*cells_ptr)[ii * params->nx + jj].speeds[3] = w1;
-      (*cells_ptr)[ii * params->nx + jj].speeds[4] = w1;
-      /* diagonals */
-      (*cells_ptr)[ii * params->nx + jj].speeds[5] = w2;
-      (*cells_ptr)[ii * params->nx + jj].speeds[6] = w2;
-      (*cells_ptr)[ii * params->nx + jj].speeds[7] = w2;
-      (*cells_ptr)[ii * params->nx + jj].speeds[8] = w2;
-    }
+    fprintf(stderr, "could not open output file: %s\n", filename);
+    return EXIT_FAILURE;
   }
 
-  /* first set all cells in obstacle array to zero */
-  for (int ii = 0; ii < params->ny; ii++)
+  for (int ii = 0; ii < nsteps; ii++)
   {
-    for (int jj = 0; jj < params->nx; jj++)
-    {
-      (*obstacles_ptr)[ii * params->nx + jj] = 0;
-    }
+    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[(size_t)ii * stride]);
   }
 
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile, "r");
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int run_ensemble(const t_param params, const int* obstacles, const char* ensemblefile)
+{
+  FILE*  fp;                    /* file pointer */
+  char   line[1024];            /* one line of the ensemble file */
+  char   filename[1024];        /* per-member output file name */
+  float* accel = NULL;          /* accel of each member */
+  float* omega = NULL;          /* omega of each member */
+  int    nmembers = 0;
+  int    capacity = 0;
+  float* av_vels;               /* av_vels[tt * nmembers + mm] */
+  float* fields;                /* u_x, u_y, u and pressure of one member */
+  d2q9_ensemble* ens;
+  double tic, toc;
+
+  fp = fopen(ensemblefile, "r");
 
   if (fp == NULL)
   {
-    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
-    die(message, __LINE__, __FILE__);
+    sprintf(line, "could not open ensemble file: %s", ensemblefile);
+    die(line, __LINE__, __FILE__);
   }
 
-  /* read-in the blocked cells list */
-  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  /* one 'accel omega' pair per line; blank lines and '#' comments are skipped */
+  while (fgets(line, sizeof(line), fp) != NULL)
   {
-    /* some checks */
-    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+    float a, o;
+    char  first;
 
-    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+    if (sscanf(line, " %c", &first) != 1 || first == '#') continue;
 
-    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+    if (sscanf(line, "%f %f", &a, &o) != 2) die("expected 'accel omega' per line in ensemble file", __LINE__, __FILE__);
 
-    if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
+    if (nmembers == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 16;
+      accel = realloc(accel, sizeof(float) * capacity);
+      omega = realloc(omega, sizeof(float) * capacity);
 
-    /* assign to array */
-    (*obstacles_ptr)[yy * params->nx + xx] = blocked;
+      if (accel == NULL || omega == NULL) die("cannot allocate memory for ensemble", __LINE__, __FILE__);
+    }
+
+    accel[nmembers] = a;
+    omega[nmembers] = o;
+    nmembers++;
   }
 
-  /* and close the file */
   fclose(fp);
 
-  /*
-  ** allocate space to hold a record of the avarage velocities computed
-  ** at each timestep
-  */
-  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
+  if (nmembers == 0) die("ensemble file has no members", __LINE__, __FILE__);
 
-  return EXIT_SUCCESS;
-}
+  av_vels = malloc(sizeof(float) * params.maxIters * nmembers);
+  fields = malloc(sizeof(float) * 4 * (params.ny * params.nx));
 
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed_temp** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr)
-{
-  /*
-  ** free up allocated memory
-  */
-  free(*cells_ptr);
-  *cells_ptr = NULL;
+  if (av_vels == NULL || fields == NULL) die("cannot allocate memory for ensemble results", __LINE__, __FILE__);
 
-  free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
+  ens = d2q9_ensemble_create(&params, obstacles, nmembers, accel, omega);
 
-  free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
-
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
-
-  return EXIT_SUCCESS;
-}
+  if (ens == NULL) die("could not create ensemble", __LINE__, __FILE__);
 
+  tic = wtime();
 
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles)
-{
-  const float viscosity = 1.0f / 6.0f * (2.0f / params.omega - 1.0f);
+  for (int tt = 0; tt < params.maxIters; tt++)
+  {
+    if (trace_enabled) trace_iteration(tt);
+    d2q9_ensemble_step(ens, 1, &av_vels[(size_t)tt * nmembers]);
+  }
 
-  return av_velocity(params, cells, obstacles) * params.reynolds_dim / viscosity;
-}
+  toc = wtime();
 
-float total_density(const t_param params, t_speed* cells)
-{
-  float total = 0.0f;  /* accumulator */
+  printf("==done==\n");
+  printf("Ensemble members:\t\t%d\n", nmembers);
+  for (int mm = 0; mm < nmembers; mm++)
+  {
+    printf("Reynolds number %d:\t\t%.12E\t(accel %g, omega %g)\n", mm,
+           d2q9_ensemble_reynolds(ens, mm), accel[mm], omega[mm]);
+  }
+  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
+  printf("Num, max num of threads:\t%d\t%d\n", omp_get_num_threads(), omp_get_max_threads());
+  perf_counters_report(stdout);
+  perf_counters_finalise();
+  trace_report(stdout, params.maxIters);
 
-  for (int ii = 0; ii < params.ny; ii++)
+  for (int mm = 0; mm < nmembers; mm++)
   {
-    for (int jj = 0; jj < params.nx; jj++)
-    {
-      for (int kk = 0; kk < NSPEEDS; kk++)
-      {
-        total += cells[ii * params.nx + jj].speeds[kk];
-      }
-    }
+    const int ncells = params.ny * params.nx;
+
+    d2q9_ensemble_get_fields(ens, mm, fields, fields + ncells, fields + 2 * ncells, fields + 3 * ncells);
+    sprintf(filename, ENSEMBLEFINALSTATEFILE, mm);
+    if (write_final_state(filename, params, obstacles, fields, fields + ncells, fields + 2 * ncells, fields + 3 * ncells)
+        != EXIT_SUCCESS)
+      die("could not write final state", __LINE__, __FILE__);
+    sprintf(filename, ENSEMBLEAVVELSFILE, mm);
+    if (write_av_vels(filename, av_vels + mm, params.maxIters, nmembers) != EXIT_SUCCESS)
+      die("could not write av_vels", __LINE__, __FILE__);
   }
 
-  return total;
+  d2q9_ensemble_destroy(ens);
+  free(fields);
+  free(av_vels);
+  free(accel);
+  free(omega);
+
+  return EXIT_SUCCESS;
 }
 
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels)
+int converged(const t_converge* converge, const d2q9_sim* sim, const float* av_vels, int tt)
 {
-  FILE* fp;                     /* file pointer */
-  const float c_sq = 1.0f / 3.0f; /* sq. of speed of sound */
-  float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
-  float u;                     /* norm--root of summed squares--of u_x and u_y */
-
-  fp = fopen(FINALSTATEFILE, "w");
+  if (converge->tol <= 0.0f && converge->l2 <= 0.0f) return 0;
 
-  if (fp == NULL)
+  /* the average velocity has to span less than tol of its mean over the window */
+  if (converge->tol > 0.0f)
   {
-    die("could not open file output file", __LINE__, __FILE__);
-  }
+    float lo, hi;
+    double sum = 0.0;
 
-  for (int ii = 0; ii < params.ny; ii++)
-  {
-    for (int jj = 0; jj < params.nx; jj++)
+    if (tt + 1 < converge->window) return 0;
+
+    lo = hi = av_vels[tt % converge->window];
+
+    /* oldest first, so that the sum does not depend on the window's position */
+    for (int ii = tt - converge->window + 1; ii <= tt; ii++)
     {
-      /* an occupied cell */
-      if (obstacles[ii * params.nx + jj])
-      {
-        u_x = u_y = u = 0.0;
-        pressure = params.density * c_sq;
-      }
-      /* no obstacle */
-      else
-      {
-        local_density = 0.0;
-
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells[ii * params.nx + jj].speeds[kk];
-        }
-
-        /* compute x velocity component */
-        u_x = (cells[ii * params.nx + jj].speeds[1]
-               + cells[ii * params.nx + jj].speeds[5]
-               + cells[ii * params.nx + jj].speeds[8]
-               - (cells[ii * params.nx + jj].speeds[3]
-                  + cells[ii * params.nx + jj].speeds[6]
-                  + cells[ii * params.nx + jj].speeds[7]))
-              / local_density;
-        /* compute y velocity component */
-        u_y = (cells[ii * params.nx + jj].speeds[2]
-               + cells[ii * params.nx + jj].speeds[5]
-               + cells[ii * params.nx + jj].speeds[6]
-               - (cells[ii * params.nx + jj].speeds[4]
-                  + cells[ii * params.nx + jj].speeds[7]
-                  + cells[ii * params.nx + jj].speeds[8]))
-              / local_density;
-        /* compute norm of velocity */
-        u = fast_sqrt((float)((u_x * u_x) + (u_y * u_y)));
-        /* compute pressure */
-        pressure = local_density * c_sq;
-      }
+      const float av_vel = av_vels[ii % converge->window];
 
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", jj, ii, u_x, u_y, u, pressure, obstacles[ii * params.nx + jj]);
+      if (av_vel < lo) lo = av_vel;
+      if (av_vel > hi) hi = av_vel;
+      sum += av_vel;
     }
-  }
 
-  fclose(fp);
+    if (hi - lo > converge->tol * (sum / converge->window)) return 0;
+  }
 
-  fp = fopen(AVVELSFILE, "w");
+  if (converge->l2 > 0.0f && d2q9_velocity_change(sim) >= converge->l2) return 0;
 
-  if (fp == NULL)
-  {
-    die("could not open file output file", __LINE__, __FILE__);
-  }
+  return 1;
+}
 
-  for (int ii = 0; ii < params.maxIters; ii++)
-  {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
-  }
+double wtime(void)
+{
+  struct timeval timstr;        /* structure to hold elapsed time */
 
-  fclose(fp);
+  gettimeofday(&timstr, NULL);
 
-  return EXIT_SUCCESS;
+  return timstr.tv_sec + (timstr.tv_usec / 1000000.0);
 }
 
 void die(const char* message, const int line, const char* file)
@@ -712,7 +806,18 @@ void die(const char* message, const int line, const char* file)
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [--perf-counters] [--timing]\n"
+                  "       [--trace <file.json>] [--trace-every <n>] [--ensemble <file>]\n"
+                  "       [--converge <tol>] [--converge-window <n>] [--converge-l2 <tol>]\n"
+                  "       [--init-state <file> | --init-fields <final_state.dat> | --multigrid <levels>]\n"
+                  "       [--save-state <file>] [--av-vels <file>|-] [--pages auto|small|hugetlb] [--pitch <n>]\n"
+                  "       [--tile <n>] [--nt-stores auto|on|off] [--prefetch <n>]\n"
+                  "       [--forcing row|body] [--autotune] [--tune-db <file>] [--no-tune]\n"
+                  "       [--reference <av_vels.dat> [--reference-final <final_state.dat>]\n"
+                  "        [--reference-tolerance <pct>]]\n"
+                  "       %s --batch <jobfile>\n"
+                  "       %s --serve <socket>\n"
+                  "       %s --request <socket> '<paramfile> <obstaclefile> [prefix [outputs]]'|-\n",
+          exe, exe, exe, exe);
   exit(EXIT_FAILURE);
 }
-
@@ -0,0 +1,131 @@
+/*
+** Functions shared by the source files of the d2q9-bgk program
+** (d2q9-bgk.c, batch.c, multigrid.c, autotune.c, reference.c,
+** av_vels_writer.c and server.c); the solver itself is in d2q9.h.
+*/
+
+#ifndef D2Q9_BGK_H
+#define D2Q9_BGK_H
+
+#include "d2q9.h"
+
+/* write the final state and the average velocity of each timestep;
+** EXIT_FAILURE, with a message on stderr, if the file cannot be opened */
+int write_final_state(const char* filename, const t_param params, const int* obstacles,
+                      const float* u_x, const float* u_y, const float* u, const float* pressure);
+int write_av_vels(const char* filename, const float* av_vels, int nsteps, int stride);
+
+/* the average velocities of a run, written as it goes by a background
+** thread, see av_vels_writer.c */
+typedef struct t_av_vels_writer t_av_vels_writer;
+
+/* filename may be "-" for a copy of stdout, taken when it is opened, so
+** that the caller may then point stdout elsewhere; NULL if it cannot be
+** opened */
+t_av_vels_writer* av_vels_writer_open(const char* filename);
+
+/* the average velocity of the next step, counting from 0 */
+void av_vels_writer_add(t_av_vels_writer* writer, float av_vel);
+
+/* write the steps still buffered and stop the thread; EXIT_FAILURE if any
+** write failed */
+int av_vels_writer_close(t_av_vels_writer* writer);
+
+/* read the velocity and pressure of every cell from a file in the format
+** written by write_final_state() */
+int read_final_state(const char* filename, const t_param params, float* u_x, float* u_y, float* pressure);
+
+/* criteria for stopping a run early, see --converge */
+typedef struct
+{
+  float tol;     /* relative spread of av_vels over the window, 0 if unused */
+  int   window;  /* steps in the window */
+  float l2;      /* relative L2 norm of the velocity change per step, 0 if unused */
+} t_converge;
+
+/* non-zero if any criteria are in use and all of them are met after step
+** tt, where av_vels[ii % window] is the average velocity of step ii for the
+** last window steps */
+int converged(const t_converge* converge, const d2q9_sim* sim, const float* av_vels, int tt);
+
+/* initialise sim from runs on levels - 1 successively coarser lattices,
+** see multigrid.c; returns the number of coarse steps taken */
+int multigrid_init(d2q9_sim* sim, const int* obstacles, int levels, const t_converge* converge);
+
+/* settings chosen by --autotune, see autotune.c */
+typedef struct
+{
+  int nthreads;
+  int prefetch;          /* software prefetch distance in cells */
+  int streaming_stores;  /* D2Q9_STREAM_ON or D2Q9_STREAM_OFF */
+  int row_pitch;         /* 0 for the automatic padding, or nx */
+  int tile;              /* d2q9_options.tile, 0 for storage by rows */
+} t_tuning;
+
+/* the tuning database: $D2Q9_TUNING_DB, or ~/.d2q9-bgk-tuning */
+const char* tuning_db_path(void);
+
+/* time candidate settings on params and obstacles, store the fastest in
+** best and record them in dbfile */
+int autotune(const char* dbfile, const t_param* params, const int* obstacles, t_tuning* best);
+
+/* non-zero if dbfile has settings for this grid size, number of threads
+** and cpu, which are then stored in tuning */
+int tuning_lookup(const char* dbfile, const t_param* params, t_tuning* tuning);
+
+/* largest difference from reference results, as reported by d2q9-check */
+typedef struct
+{
+  long   max_index;     /* step, or line of the final state */
+  double max_diff;
+  double max_pcnt;
+  double sim_val;
+  double ref_val;
+  double total;         /* sum of the absolute differences */
+} t_ref_stats;
+
+/* reference results to validate a run against, see reference.c */
+#define REFERENCE_TOLERANCE 1.0  /* % */
+
+typedef struct
+{
+  double      tolerance;  /* % */
+  double*     av_vels;    /* of each step */
+  int         nsteps;
+  int*        coords;     /* jj, ii of each line of the reference final state */
+  double*     pressure;   /* and its pressure */
+  int         ncells;     /* lines of the final state, 0 if there is none */
+  t_ref_stats av_vels_stats;
+  t_ref_stats final_state_stats;
+} t_reference;
+
+/* read the reference av_vels, of at least maxIters steps, and the final
+** state of a run of exactly maxIters steps if final_state_file is not NULL */
+int reference_read(t_reference* reference, const char* av_vels_file, const char* final_state_file,
+                   const t_param params);
+
+/* non-zero if the average velocity of step tt is within tolerance;
+** prints the difference if not */
+int reference_check_step(t_reference* reference, int tt, float av_vel);
+
+/* print the statistics of the run so far and check the final state, if
+** any; non-zero if it is within tolerance */
+int reference_check_final(t_reference* reference, const d2q9_sim* sim);
+void reference_free(t_reference* reference);
+
+/* run every job of jobfile on disjoint sets of cores, see batch.c */
+int run_batch(const char* jobfile);
+
+/* run the jobs sent to socketpath until told to quit, and send one job
+** line or the lines of stdin for "-" to such a server, printing the
+** replies; see server.c */
+int run_server(const char* socketpath);
+int server_request(const char* socketpath, const char* request);
+
+/* elapsed wallclock time in seconds */
+double wtime(void);
+
+/* utility functions */
+void die(const char* message, const int line, const char* file);
+
+#endif
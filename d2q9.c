@@ -0,0 +1,1493 @@
+/*
+** Code to implement a d2q9-bgk lattice boltzmann scheme.
+** 'd2' inidates a 2-dimensional grid, and
+** 'q9' indicates 9 velocities per grid cell.
+** 'bgk' refers to the Bhatnagar-Gross-Krook collision step.
+**
+** The 'speeds' in each cell are numbered as follows:
+**
+** 6 2 5
+**  \|/
+** 3-0-1
+**  /|\
+** 7 4 8
+**
+** A 2D grid:
+**
+**           cols
+**       --- --- ---
+**      | D | E | F |
+** rows  --- --- ---
+**      | A | B | C |
+**       --- --- ---
+**
+** 'unwrapped' in row major order to give a 1D array:
+**
+**  --- --- --- --- --- ---
+** | A | B | C | D | E | F |
+**  --- --- --- --- --- ---
+**
+** Grid indicies are:
+**
+**          ny
+**          ^       cols(jj)
+**          |  ----- ----- -----
+**          | | ... | ... | etc |
+**          |  ----- ----- -----
+** rows(ii) | | 1,0 | 1,1 | 1,2 |
+**          |  ----- ----- -----
+**          | | 0,0 | 0,1 | 0,2 |
+**          |  ----- ----- -----
+**          ----------------------> nx
+**
+** This file is the solver library, see d2q9.h for its interface;
+** d2q9-bgk.c is the command line program built on it.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<math.h>
+#include<string.h>
+#include<stdint.h>
+#include<unistd.h>
+#include <emmintrin.h>
+#include <omp.h>
+
+#include "d2q9.h"
+#include "d2q9_internal.h"
+#include "instrument.h"
+
+/* struct to hold the 'speed' values */
+typedef struct
+{
+  float speeds[NSPEEDS];
+} t_speed;
+
+/* struct to hold the 'speed' temporary values and calculated derivatives */
+typedef struct
+{
+    float speeds[NSPEEDS];
+    float local_density;
+    float u_x;
+    float u_y;
+} t_speed_temp;
+
+/* header of a file written by d2q9_save_state(), followed by the
+** nx * ny * NSPEEDS distributions in the order of the cells array */
+#define STATE_MAGIC "D2Q9STA1"
+
+typedef struct
+{
+  char    magic[8];
+  int32_t nx;
+  int32_t ny;
+  int32_t nspeeds;
+  int32_t float_size;
+} t_state_header;
+
+/* cells staged at a time by rebound_and_collision() for streaming stores,
+** 36 cache lines */
+#define STREAM_CHUNK    64
+
+/* kinds of run */
+#define RUN_WALL   0    /* blocked cells with a non-blocked neighbour */
+#define RUN_FLUID  1    /* non-blocked cells on the west or east edge of a
+                        ** tile, which by rows is the periodic edge, or whose
+                        ** row reads from the row accelerate_flow() forces */
+#define RUN_BULK   2    /* the other non-blocked cells, which propagate()
+                        ** streams with a plain stencil */
+
+/* cells start <= jj < end of one row of a tile, all of one kind; a blocked cell
+** whose eight neighbours are all blocked is in no run, as what it holds
+** only ever reaches other blocked cells */
+typedef struct
+{
+  int start;
+  int end;
+  int kind;     /* RUN_* */
+} t_run;
+
+/*
+** The grids are stored as tiles of tile_h rows of pitch cells, tile after
+** tile along each band of tile_h rows, and band after band. By default a
+** tile is one row, padded to pitch >= nx cells, which is plain row major
+** order. With d2q9_options.tile the tiles are tile x tile cells, so that
+** the rows north and south of a cell are pitch cells away rather than a
+** whole row. Either way the cells of one row of a tile are contiguous, and
+** the kernels work on these segments through the helpers below.
+*/
+
+/* index of cell (ii, jj) in the grids */
+static inline size_t cell_index(const d2q9_sim* sim, int ii, int jj);
+
+/* offset of the segment of row ii in tile column tx, less tx * pitch, so
+** that cell (ii, jj) of that tile column is at this offset + jj */
+static inline size_t seg_base(const d2q9_sim* sim, int ii, int tx);
+
+/* tile tt, counting tile after tile along each band, is in tile column *tx
+** and covers the cells ii0 <= ii < ii1, jj0 <= jj < jj1 of the grid */
+static inline void tile_bounds(const d2q9_sim* sim, int tt, int* tx, int* ii0, int* ii1, int* jj0, int* jj1);
+
+/* the state of one simulation */
+struct d2q9_sim
+{
+  t_param       params;     /* struct to hold parameter values */
+  t_speed*      cells;      /* grid containing fluid densities */
+  t_speed_temp* tmp_cells;  /* scratch space */
+  int*          obstacles;  /* grid indicating which cells are blocked */
+  int           pitch;      /* cells per row of a tile in the three grids above */
+  int           tile;       /* tile edge in cells, 0 when stored by rows */
+  int           tile_h;     /* rows per tile */
+  int           tiles_x;    /* tiles across the grid */
+  int           bands;      /* tiles down the grid */
+  int           stream_stores; /* write cells with non-temporal stores */
+  t_arena       arena;      /* holds cells, tmp_cells and obstacles */
+  t_run*        runs;       /* the runs of each row of each tile, left to right */
+  int*          seg_runs;   /* row ii of tile column tx, segment ii * tiles_x + tx,
+                            ** has runs[seg_runs[seg]] up to runs[seg_runs[seg + 1]] */
+  int           tot_cells;  /* number of non-blocked cells */
+  int           iterations; /* timesteps taken so far */
+  int           nthreads;   /* OpenMP team size of the kernels */
+  int           prefetch;   /* software prefetch distance of propagate() in cells, 0 for none */
+  float*        prev_u;     /* u_x, u_y of each cell after the previous step, if tracked */
+  float         velocity_change; /* relative L2 norm of the last change in velocity */
+
+  /* accelerate_flow() constants: */
+  /* weighting factors */
+  float accelerate_flow_w1, accelerate_flow_w2;
+  /* 2nd row of the grid */
+  int accelerate_flow_ii;
+  /* nx flags, non-zero for the non-blocked cells of that row; all zero
+  ** with a body force */
+  int* forcing_cells;
+  /* D2Q9_FORCE_*, and the x component of the Guo body force on every
+  ** non-blocked cell, or 0 */
+  int   forcing;
+  float body_force;
+  /* av_velocity() sums of |u|, |du|^2 and |u|^2 over each row */
+  float* row_sums;
+};
+
+/*
+** The main calculation methods.
+** timestep calls, in order, the functions:
+** propagate() & rebound_and_collision(), where propagate() also applies
+** the forcing of accelerate_flow() to the values it reads. Both only visit
+** the cells in runs, so the inside of large obstacles costs nothing
+*/
+static void timestep(d2q9_sim* sim);
+static void propagate(d2q9_sim* sim);
+static void rebound_and_collision(d2q9_sim* sim);
+
+/* set params, the obstacles and the forcing, and the distributions to the
+** uniform equilibrium, each row by the thread which runs it in the kernels */
+static void init_lattice(d2q9_sim* sim, const t_param* params, const int* obstacles);
+
+/* split each row into runs */
+static void init_runs(d2q9_sim* sim, const t_param* params, const int* obstacles);
+
+/* size of the last level cache in bytes, 0 if unknown */
+static long llc_size(void);
+
+/* copy n floats with non-temporal stores */
+static inline void stream_copy(float* dst, const float* src, int n);
+
+/* compute average velocity; if prev_u is not NULL also the relative L2
+** norm of the change in velocity since prev_u, which is then updated */
+static float av_velocity(const d2q9_sim* sim, float* prev_u, float* change);
+
+int d2q9_read_params(const char* paramfile, t_param* params)
+{
+  char   message[1024];  /* message buffer */
+  FILE*   fp;            /* file pointer */
+  const char* problem = NULL; /* first error found in the file */
+
+  /* open the parameter file */
+  fp = fopen(paramfile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input parameter file: %s", paramfile);
+    d2q9_error(message, __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  /* read in the parameter values */
+  if (fscanf(fp, "%d\n", &(params->nx)) != 1) problem = "could not read param file: nx";
+  else if (fscanf(fp, "%d\n", &(params->ny)) != 1) problem = "could not read param file: ny";
+  else if (fscanf(fp, "%d\n", &(params->maxIters)) != 1) problem = "could not read param file: maxIters";
+  else if (fscanf(fp, "%d\n", &(params->reynolds_dim)) != 1) problem = "could not read param file: reynolds_dim";
+  else if (fscanf(fp, "%f\n", &(params->density)) != 1) problem = "could not read param file: density";
+  else if (fscanf(fp, "%f\n", &(params->accel)) != 1) problem = "could not read param file: accel";
+  else if (fscanf(fp, "%f\n", &(params->omega)) != 1) problem = "could not read param file: omega";
+
+  /* and close up the file */
+  fclose(fp);
+
+  if (problem != NULL)
+  {
+    d2q9_error(problem, __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int d2q9_read_obstacles(const char* obstaclefile, const t_param* params, int* obstacles)
+{
+  char   message[1024];  /* message buffer */
+  FILE*   fp;            /* file pointer */
+  int    xx, yy;         /* generic array indices */
+  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
+  int    retval;         /* to hold return value for checking */
+  const char* problem = NULL; /* first error found in the file */
+
+  /* first set all cells in obstacle array to zero */
+  for (int ii = 0; ii < params->ny; ii++)
+  {
+    for (int jj = 0; jj < params->nx; jj++)
+    {
+      obstacles[ii * params->nx + jj] = 0;
+    }
+  }
+
+  /* open the obstacle data file */
+  fp = fopen(obstaclefile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    d2q9_error(message, __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  /* read-in the blocked cells list */
+  while (problem == NULL && (retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    /* some checks */
+    if (retval != 3) problem = "expected 3 values per line in obstacle file";
+    else if (xx < 0 || xx > params->nx - 1) problem = "obstacle x-coord out of range";
+    else if (yy < 0 || yy > params->ny - 1) problem = "obstacle y-coord out of range";
+    else if (blocked != 1) problem = "obstacle blocked value should be 1";
+    /* assign to array */
+    else obstacles[yy * params->nx + xx] = blocked;
+  }
+
+  /* and close the file */
+  fclose(fp);
+
+  if (problem != NULL)
+  {
+    d2q9_error(problem, __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void d2q9_default_options(d2q9_options* options)
+{
+  options->pages = D2Q9_PAGES_AUTO;
+  options->row_pitch = 0;
+  options->streaming_stores = D2Q9_STREAM_AUTO;
+  options->forcing = D2Q9_FORCE_ROW;
+  options->tile = 0;
+}
+
+d2q9_sim* d2q9_create(const t_param* params, const int* obstacles)
+{
+  d2q9_options options;
+
+  d2q9_default_options(&options);
+
+  return d2q9_create_with_options(params, obstacles, &options);
+}
+
+d2q9_sim* d2q9_create_with_options(const t_param* params, const int* obstacles,
+                                   const d2q9_options* options)
+{
+  d2q9_sim* sim;
+  const size_t elem_sizes[] = { sizeof(t_speed), sizeof(t_speed_temp), sizeof(int) };
+  size_t ncells;        /* cells stored per grid, including row padding */
+
+  if (params->nx < 1 || params->ny < 3)
+  {
+    d2q9_error("grid must be at least 1x3 cells", __LINE__, __FILE__);
+    return NULL;
+  }
+
+  if (options->tile < 0 || (options->tile != 0 && options->row_pitch != 0))
+  {
+    d2q9_error("tile must be positive, and cannot be combined with a row pitch", __LINE__, __FILE__);
+    return NULL;
+  }
+
+  if (options->row_pitch != 0 && options->row_pitch < params->nx)
+  {
+    d2q9_error("row pitch must be at least nx", __LINE__, __FILE__);
+    return NULL;
+  }
+
+  if (options->forcing != D2Q9_FORCE_ROW && options->forcing != D2Q9_FORCE_BODY)
+  {
+    d2q9_error("unknown forcing scheme", __LINE__, __FILE__);
+    return NULL;
+  }
+
+  sim = calloc(1, sizeof(d2q9_sim));
+
+  if (sim == NULL)
+  {
+    d2q9_error("cannot allocate memory for simulation", __LINE__, __FILE__);
+    return NULL;
+  }
+
+  sim->nthreads = omp_get_max_threads();
+
+  /*
+  ** Allocate memory.
+  **
+  ** NB we are allocating a 1D array, so that the
+  ** memory will be contiguous.  We still want to
+  ** index this memory as if it were a (row major
+  ** ordered) 2D array, however.  We will perform
+  ** some arithmetic using the row and column
+  ** coordinates, inside the square brackets, when
+  ** we want to access elements of this array.
+  **
+  ** Note also that we are using a structure to
+  ** hold an array of 'speeds'.  We will allocate
+  ** a 1D array of these structs.
+  **
+  ** All three grids are carved from one arena, see arena.c.
+  ** Rows are pitch cells apart, where the padding at the end of each
+  ** row is never read, so that the rows which a kernel streams through
+  ** at the same time do not alias each other's cache sets. Tiles are
+  ** padded to whole tiles at the east and south edges of the grid.
+  */
+  sim->tile = options->tile;
+
+  if (options->tile)
+  {
+    sim->pitch = options->tile;
+    sim->tile_h = options->tile;
+    sim->tiles_x = (params->nx + options->tile - 1) / options->tile;
+    sim->bands = (params->ny + options->tile - 1) / options->tile;
+  }
+  else
+  {
+    sim->pitch = options->row_pitch ? options->row_pitch
+               : arena_row_pitch(params->nx, elem_sizes, sizeof(elem_sizes) / sizeof(elem_sizes[0]));
+    sim->tile_h = 1;
+    sim->tiles_x = 1;
+    sim->bands = params->ny;
+  }
+  ncells = (size_t)sim->pitch * sim->tiles_x * sim->tile_h * sim->bands;
+
+  /* once the two grids do not fit in the last level cache, the lines of
+  ** cells written by the collision would only be read for ownership */
+  if (options->streaming_stores == D2Q9_STREAM_AUTO)
+  {
+    const long llc = llc_size();
+
+    sim->stream_stores = llc > 0 && (sizeof(t_speed) + sizeof(t_speed_temp)) * ncells > (size_t)llc;
+  }
+  else
+  {
+    sim->stream_stores = options->streaming_stores == D2Q9_STREAM_ON;
+  }
+
+  if (arena_create(&sim->arena, arena_size(sizeof(t_speed) * ncells)
+                   + arena_size(sizeof(t_speed_temp) * ncells)
+                   + arena_size(sizeof(int) * ncells)
+                   + arena_size(sizeof(int) * params->nx)
+                   + arena_size(sizeof(float) * 3 * params->ny)
+                   + arena_size(sizeof(t_run) * (size_t)params->nx * params->ny)
+                   + arena_size(sizeof(int) * ((size_t)params->ny * sim->tiles_x + 1)), options->pages) != EXIT_SUCCESS)
+  {
+    d2q9_destroy(sim);
+    return NULL;
+  }
+
+  /* main grid */
+  sim->cells = arena_alloc(&sim->arena, sizeof(t_speed) * ncells);
+
+  /* 'helper' grid, used as scratch space */
+  sim->tmp_cells = arena_alloc(&sim->arena, sizeof(t_speed_temp) * ncells);
+
+  /* the map of obstacles */
+  sim->obstacles = arena_alloc(&sim->arena, sizeof(int) * ncells);
+
+  /* the cells of the accelerated row which are not blocked */
+  sim->forcing_cells = arena_alloc(&sim->arena, sizeof(int) * params->nx);
+
+  /* partial sums of the reductions */
+  sim->row_sums = arena_alloc(&sim->arena, sizeof(float) * 3 * params->ny);
+
+  /* the runs, at most one per cell; only the pages used are touched */
+  sim->runs = arena_alloc(&sim->arena, sizeof(t_run) * (size_t)params->nx * params->ny);
+  sim->seg_runs = arena_alloc(&sim->arena, sizeof(int) * ((size_t)params->ny * sim->tiles_x + 1));
+
+  if (sim->cells == NULL || sim->tmp_cells == NULL || sim->obstacles == NULL || sim->forcing_cells == NULL
+      || sim->row_sums == NULL || sim->runs == NULL || sim->seg_runs == NULL)
+  {
+    d2q9_error("cannot allocate memory for grids", __LINE__, __FILE__);
+    d2q9_destroy(sim);
+    return NULL;
+  }
+
+  sim->forcing = options->forcing;
+  init_lattice(sim, params, obstacles);
+
+  return sim;
+}
+
+int d2q9_reset(d2q9_sim* sim, const t_param* params, const int* obstacles)
+{
+  if (params->nx != sim->params.nx || params->ny != sim->params.ny)
+  {
+    d2q9_error("cannot reset a simulation to another grid size", __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  init_lattice(sim, params, obstacles);
+
+  return EXIT_SUCCESS;
+}
+
+void d2q9_step(d2q9_sim* sim, int nsteps, float* av_vels)
+{
+  for (int tt = 0; tt < nsteps; tt++)
+  {
+    timestep(sim);
+    sim->iterations++;
+
+    if (av_vels != NULL || sim->prev_u != NULL)
+    {
+      const float av = av_velocity(sim, sim->prev_u, &sim->velocity_change);
+
+      if (av_vels != NULL) av_vels[tt] = av;
+    }
+  }
+}
+
+void d2q9_set_threads(d2q9_sim* sim, int nthreads)
+{
+  sim->nthreads = nthreads > 0 ? nthreads : omp_get_max_threads();
+}
+
+int d2q9_threads(const d2q9_sim* sim)
+{
+  return sim->nthreads;
+}
+
+void d2q9_set_prefetch(d2q9_sim* sim, int distance)
+{
+  sim->prefetch = distance > 0 ? distance : 0;
+}
+
+int d2q9_prefetch(const d2q9_sim* sim)
+{
+  return sim->prefetch;
+}
+
+int d2q9_track_velocity_change(d2q9_sim* sim, int enable)
+{
+  if (!enable)
+  {
+    free(sim->prev_u);
+    sim->prev_u = NULL;
+    sim->velocity_change = -1.0f;
+  }
+  else if (sim->prev_u == NULL)
+  {
+    /* the first step compares against a fluid at rest */
+    sim->prev_u = calloc(2 * (size_t)sim->params.nx * sim->params.ny, sizeof(float));
+
+    if (sim->prev_u == NULL)
+    {
+      d2q9_error("cannot allocate memory for velocity change", __LINE__, __FILE__);
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+float d2q9_velocity_change(const d2q9_sim* sim)
+{
+  return sim->velocity_change;
+}
+
+int d2q9_row_pitch(const d2q9_sim* sim)
+{
+  return sim->pitch;
+}
+
+int d2q9_tile(const d2q9_sim* sim)
+{
+  return sim->tile;
+}
+
+float d2q9_body_force(const d2q9_sim* sim)
+{
+  return sim->body_force;
+}
+
+int d2q9_streaming_stores(const d2q9_sim* sim)
+{
+  return sim->stream_stores;
+}
+
+long d2q9_page_size(const d2q9_sim* sim)
+{
+  return arena_page_size(&sim->arena);
+}
+
+int d2q9_iterations(const d2q9_sim* sim)
+{
+  return sim->iterations;
+}
+
+const t_param* d2q9_params(const d2q9_sim* sim)
+{
+  return &sim->params;
+}
+
+static inline size_t cell_index(const d2q9_sim* sim, int ii, int jj)
+{
+  return ((size_t)(ii / sim->tile_h) * sim->tiles_x + jj / sim->pitch) * sim->pitch * sim->tile_h
+         + (size_t)(ii % sim->tile_h) * sim->pitch + jj % sim->pitch;
+}
+
+static inline size_t seg_base(const d2q9_sim* sim, int ii, int tx)
+{
+  return cell_index(sim, ii, tx * sim->pitch) - (size_t)tx * sim->pitch;
+}
+
+static inline void tile_bounds(const d2q9_sim* sim, int tt, int* tx, int* ii0, int* ii1, int* jj0, int* jj1)
+{
+  *tx = tt % sim->tiles_x;
+  *ii0 = tt / sim->tiles_x * sim->tile_h;
+  *ii1 = *ii0 + sim->tile_h < sim->params.ny ? *ii0 + sim->tile_h : sim->params.ny;
+  *jj0 = *tx * sim->pitch;
+  *jj1 = *jj0 + sim->pitch < sim->params.nx ? *jj0 + sim->pitch : sim->params.nx;
+}
+
+static void init_lattice(d2q9_sim* sim, const t_param* params, const int* obstacles)
+{
+  const float w0 = params->density * 4.0f / 9.0f;
+  const float w1 = params->density      / 9.0f;
+  const float w2 = params->density      / 36.0f;
+  int tot_cells = 0;
+
+  sim->params = *params;
+  sim->iterations = 0;
+  sim->velocity_change = -1.0f;
+  sim->body_force = 0.0f;
+
+  if (sim->prev_u != NULL) memset(sim->prev_u, 0, sizeof(float) * 2 * (size_t)params->nx * params->ny);
+
+  /* first touch by the same tiles as the kernels' static schedule, so that
+  ** the pages of each tile are local to the thread which updates it */
+#pragma omp parallel for num_threads(sim->nthreads) reduction(+:tot_cells)
+  for (int tt = 0; tt < sim->bands * sim->tiles_x; tt++)
+  {
+    int tx, ii0, ii1, jj0, jj1;
+
+    tile_bounds(sim, tt, &tx, &ii0, &ii1, &jj0, &jj1);
+
+    for (int ii = ii0; ii < ii1; ii++)
+    {
+      t_speed* cells = &sim->cells[seg_base(sim, ii, tx)];
+      t_speed_temp* tmp_cells = &sim->tmp_cells[seg_base(sim, ii, tx)];
+      int* blocked = &sim->obstacles[seg_base(sim, ii, tx)];
+
+      for (int jj = jj0; jj < jj1; jj++)
+      {
+        /* centre */
+        cells[jj].speeds[0] = w0;
+        /* axis directions */
+        cells[jj].speeds[1] = w1;
+        cells[jj].speeds[2] = w1;
+        cells[jj].speeds[3] = w1;
+        cells[jj].speeds[4] = w1;
+        /* diagonals */
+        cells[jj].speeds[5] = w2;
+        cells[jj].speeds[6] = w2;
+        cells[jj].speeds[7] = w2;
+        cells[jj].speeds[8] = w2;
+
+        memset(&tmp_cells[jj], 0, sizeof(t_speed_temp));
+
+        blocked[jj] = obstacles[ii * params->nx + jj];
+
+        if (!obstacles[ii * params->nx + jj])
+        {
+          tot_cells++;
+        }
+      }
+    }
+  }
+
+  sim->tot_cells = tot_cells;
+
+  /* set up accelerate_flow() constants */
+  sim->accelerate_flow_w1 = params->density * params->accel / 9.0f;
+  sim->accelerate_flow_w2 = params->density * params->accel / 36.0f;
+  sim->accelerate_flow_ii = params->ny - 2;
+
+  for (int jj = 0; jj < params->nx; jj++)
+  {
+    sim->forcing_cells[jj] = !obstacles[sim->accelerate_flow_ii * params->nx + jj];
+  }
+
+  /* a body force putting in the momentum accelerate_flow() would,
+  ** density * accel / 3 per forced cell, spread over every fluid cell */
+  if (sim->forcing == D2Q9_FORCE_BODY && sim->tot_cells > 0)
+  {
+    int nforced = 0;
+
+    for (int jj = 0; jj < params->nx; jj++)
+    {
+      nforced += sim->forcing_cells[jj];
+      sim->forcing_cells[jj] = 0;
+    }
+
+    sim->body_force = params->density * params->accel / 3.0f * nforced / sim->tot_cells;
+  }
+
+  init_runs(sim, params, obstacles);
+}
+
+static void init_runs(d2q9_sim* sim, const t_param* params, const int* obstacles)
+{
+  const int accelerate_flow_ii = sim->accelerate_flow_ii;
+  int nruns = 0;
+
+  for (int ii = 0; ii < params->ny; ii++)
+  {
+    /* rows which read from the accelerated row, when it is forced */
+    const int near_forcing = sim->forcing == D2Q9_FORCE_ROW
+                             && (ii == accelerate_flow_ii
+                                 || (ii + 1) % params->ny == accelerate_flow_ii
+                                 || (ii + params->ny - 1) % params->ny == accelerate_flow_ii);
+
+    for (int jj = 0; jj < params->nx; jj++)
+    {
+      const int fluid = !obstacles[ii * params->nx + jj];
+      int wet = fluid;  /* fluid, or blocked next to fluid */
+      int kind;
+
+      /* each row of each tile has runs of its own */
+      if (jj % sim->pitch == 0) sim->seg_runs[ii * sim->tiles_x + jj / sim->pitch] = nruns;
+
+      /* the eight neighbours, respecting periodic boundary conditions */
+      for (int dy = -1; dy <= 1 && !wet; dy++)
+      {
+        for (int dx = -1; dx <= 1 && !wet; dx++)
+        {
+          const int y = (ii + dy + params->ny) % params->ny;
+          const int x = (jj + dx + params->nx) % params->nx;
+
+          wet = !obstacles[y * params->nx + x];
+        }
+      }
+
+      if (!wet) continue;
+
+      /* whether the neighbours are blocked does not matter to the stencil,
+      ** as blocked cells hold their bounced-back values */
+      if (!fluid) kind = RUN_WALL;
+      else if (near_forcing || jj % sim->pitch == 0 || jj % sim->pitch == sim->pitch - 1 || jj == params->nx - 1)
+        kind = RUN_FLUID;
+      else kind = RUN_BULK;
+
+      if (jj % sim->pitch != 0 && nruns > 0 && sim->runs[nruns - 1].end == jj && sim->runs[nruns - 1].kind == kind)
+      {
+        sim->runs[nruns - 1].end++;
+      }
+      else
+      {
+        sim->runs[nruns].start = jj;
+        sim->runs[nruns].end = jj + 1;
+        sim->runs[nruns].kind = kind;
+        nruns++;
+      }
+    }
+  }
+
+  sim->seg_runs[params->ny * sim->tiles_x] = nruns;
+}
+
+static void timestep(d2q9_sim* sim)
+{
+  propagate(sim);
+  rebound_and_collision(sim);
+}
+
+/* non-zero if accelerate_flow() forces cell jj of its row: the cell is
+** not blocked and we don't send a negative density */
+static inline int forced(const d2q9_sim* sim, const t_speed* row, int jj)
+{
+  return sim->forcing_cells[jj]
+         && (row[jj].speeds[3] - sim->accelerate_flow_w1) > 0.0
+         && (row[jj].speeds[6] - sim->accelerate_flow_w2) > 0.0
+         && (row[jj].speeds[7] - sim->accelerate_flow_w2) > 0.0;
+}
+
+/* propagate densities to cell jj of a row, following appropriate
+** directions of travel and writing into scratch space grid; south, row
+** and north are the rows around it, and *_w and *_e the same rows of the
+** tiles holding x_w and x_e, the columns west and east of jj */
+static inline void pull(t_speed_temp* out,
+                        const t_speed* south_w, const t_speed* row_w, const t_speed* north_w, int x_w,
+                        const t_speed* south, const t_speed* row, const t_speed* north, int jj,
+                        const t_speed* south_e, const t_speed* row_e, const t_speed* north_e, int x_e)
+{
+  out->speeds[0] = row[jj].speeds[0];
+  out->speeds[1] = row_w[x_w].speeds[1];
+  out->speeds[2] = south[jj].speeds[2];
+  out->speeds[3] = row_e[x_e].speeds[3];
+  out->speeds[4] = north[jj].speeds[4];
+  out->speeds[5] = south_w[x_w].speeds[5];
+  out->speeds[6] = south_e[x_e].speeds[6];
+  out->speeds[7] = north_e[x_e].speeds[7];
+  out->speeds[8] = north_w[x_w].speeds[8];
+}
+
+/* the nine directions are read from three rows, each streamed left to
+** right, and written to one; fetch them at cell jj, prefetch cells ahead.
+** Past the end of a segment this is the start of the next one in memory:
+** the next row of the tile, which the following iteration of ii reads,
+** or after the last row of a tile the next tile along the band, which is
+** only useful if the same thread takes it. Stored by rows, that is the
+** next row. A prefetch cannot fault, so it is not clamped */
+static inline void prefetch_cells(const t_speed* south, const t_speed* row, const t_speed* north,
+                                  const t_speed_temp* out, int jj)
+{
+  __builtin_prefetch(&south[jj], 0, 3);
+  __builtin_prefetch(&row[jj], 0, 3);
+  __builtin_prefetch(&north[jj], 0, 3);
+  __builtin_prefetch(&out[jj], 1, 3);
+}
+
+/* the local density and velocity of the values pulled into out */
+static inline void moments(t_speed_temp* out)
+{
+  /* compute local density total */
+  out->local_density = out->speeds[0] + out->speeds[1] + out->speeds[2]
+                       + out->speeds[3] + out->speeds[4] + out->speeds[5]
+                       + out->speeds[6] + out->speeds[7] + out->speeds[8];
+
+  /* compute x velocity component */
+  out->u_x = (out->speeds[1] + out->speeds[5] + out->speeds[8]
+              - (out->speeds[3] + out->speeds[6] + out->speeds[7]))
+             / out->local_density;
+
+  /* compute y velocity component */
+  out->u_y = (out->speeds[2] + out->speeds[5] + out->speeds[6]
+              - (out->speeds[4] + out->speeds[7] + out->speeds[8]))
+             / out->local_density;
+}
+
+static void propagate(d2q9_sim* sim)
+{
+  const t_param params = sim->params;
+  const int tiles_x = sim->tiles_x;
+  const int prefetch = sim->prefetch;
+  const t_speed* cells = sim->cells;
+  t_speed_temp* tmp_cells = sim->tmp_cells;
+  const float accelerate_flow_w1 = sim->accelerate_flow_w1;
+  const float accelerate_flow_w2 = sim->accelerate_flow_w2;
+  const int accelerate_flow_ii = sim->accelerate_flow_ii;
+  const t_run* runs = sim->runs;
+  const int* seg_runs = sim->seg_runs;
+
+  /* loop over the cells in runs, tile by tile */
+#pragma omp parallel num_threads(sim->nthreads)
+  {
+    phase_begin(PHASE_PROPAGATE);
+#pragma omp for nowait
+    for (int tt = 0; tt < sim->bands * tiles_x; tt++)
+    {
+      int tx, ii0, ii1, jj0, jj1;
+
+      tile_bounds(sim, tt, &tx, &ii0, &ii1, &jj0, &jj1);
+
+      /* the tile columns west and east, respecting periodic boundary conditions */
+      const int tx_w = (tx == 0) ? (tiles_x - 1) : (tx - 1);
+      const int tx_e = (tx + 1) % tiles_x;
+      /* the row accelerate_flow() forces, in the three tile columns */
+      const t_speed* accelerated_w = &cells[seg_base(sim, accelerate_flow_ii, tx_w)];
+      const t_speed* accelerated = &cells[seg_base(sim, accelerate_flow_ii, tx)];
+      const t_speed* accelerated_e = &cells[seg_base(sim, accelerate_flow_ii, tx_e)];
+
+      for (int ii = ii0; ii < ii1; ii++)
+      {
+        /* determine indices of axis-direction neighbours
+        ** respecting periodic boundary conditions (wrap around) */
+        const int y_n = (ii + 1) % params.ny;
+        const int y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
+        const t_speed* south = &cells[seg_base(sim, y_s, tx)];
+        const t_speed* row = &cells[seg_base(sim, ii, tx)];
+        const t_speed* north = &cells[seg_base(sim, y_n, tx)];
+        const t_speed* south_w = &cells[seg_base(sim, y_s, tx_w)];
+        const t_speed* row_w = &cells[seg_base(sim, ii, tx_w)];
+        const t_speed* north_w = &cells[seg_base(sim, y_n, tx_w)];
+        const t_speed* south_e = &cells[seg_base(sim, y_s, tx_e)];
+        const t_speed* row_e = &cells[seg_base(sim, ii, tx_e)];
+        const t_speed* north_e = &cells[seg_base(sim, y_n, tx_e)];
+        t_speed_temp* out = &tmp_cells[seg_base(sim, ii, tx)];
+        const int seg = ii * tiles_x + tx;
+
+        /* rows which read from the accelerated row */
+        const int near_forcing = ii == accelerate_flow_ii || y_n == accelerate_flow_ii || y_s == accelerate_flow_ii;
+
+        for (int rr = seg_runs[seg]; rr < seg_runs[seg + 1]; rr++)
+        {
+          const t_run run = runs[rr];
+
+          if (run.kind == RUN_BULK)
+          {
+            /* no wrap around, no other tile and no forcing: a plain stencil */
+            for (int jj = run.start; jj < run.end; jj++)
+            {
+              if (prefetch) prefetch_cells(south, row, north, out, jj + prefetch);
+              pull(&out[jj], south, row, north, jj - 1, south, row, north, jj, south, row, north, jj + 1);
+              moments(&out[jj]);
+            }
+            continue;
+          }
+
+          for (int jj = run.start; jj < run.end; jj++)
+          {
+            const int x_e = (jj + 1) % params.nx;
+            const int x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
+            /* the neighbours west and east are in the next tiles at the
+            ** edges of this one */
+            const int west = jj == jj0;
+            const int east = jj == jj1 - 1;
+
+            if (prefetch) prefetch_cells(south, row, north, out, jj + prefetch);
+            pull(&out[jj], west ? south_w : south, west ? row_w : row, west ? north_w : north, x_w,
+                 south, row, north, jj,
+                 east ? south_e : south, east ? row_e : row, east ? north_e : north, x_e);
+
+            /* accelerate the flow: the densities read from the forced row are
+            ** those accelerate_flow() would have left there, increased on the
+            ** 'east side' (1, 5, 8) and decreased on the 'west side' (3, 6, 7).
+            ** Whether a cell is forced only depends on its own values, so
+            ** every thread can decide it without cells being written */
+            if (near_forcing)
+            {
+              const t_speed* forced_w = west ? accelerated_w : accelerated;
+              const t_speed* forced_e = east ? accelerated_e : accelerated;
+
+              if (ii == accelerate_flow_ii)
+              {
+                if (forced(sim, forced_w, x_w)) out[jj].speeds[1] += accelerate_flow_w1;
+                if (forced(sim, forced_e, x_e)) out[jj].speeds[3] -= accelerate_flow_w1;
+              }
+              if (y_s == accelerate_flow_ii)
+              {
+                if (forced(sim, forced_w, x_w)) out[jj].speeds[5] += accelerate_flow_w2;
+                if (forced(sim, forced_e, x_e)) out[jj].speeds[6] -= accelerate_flow_w2;
+              }
+              if (y_n == accelerate_flow_ii)
+              {
+                if (forced(sim, forced_e, x_e)) out[jj].speeds[7] -= accelerate_flow_w2;
+                if (forced(sim, forced_w, x_w)) out[jj].speeds[8] += accelerate_flow_w2;
+              }
+            }
+
+            moments(&out[jj]);
+          }
+        }
+      }
+    }
+    phase_end(PHASE_PROPAGATE);
+    phase_barrier();
+  }
+}
+
+/* the collision of n non-blocked cells, from the values propagate() left
+** in in, written to out */
+static inline void collide(t_speed* out, const t_speed_temp* in, int n, float omega, float force)
+{
+  const float force_w = (1.0f - 0.5f * omega) * force; /* Guo's source term prefactor */
+  static const float w0 = 4.0f / 9.0f;  /* weighting factor */
+  static const float w1 = 1.0f / 9.0f;  /* weighting factor */
+  static const float w2 = 1.0f / 36.0f; /* weighting factor */
+
+  /* no occupied cells, so no branch per cell */
+  for (int jj = 0; jj < n; jj++)
+  {
+    const float local_density = in[jj].local_density;
+    float u_x = in[jj].u_x;
+    const float u_y = in[jj].u_y;
+    /* equilibrium densities */
+    float d_equ[NSPEEDS];
+
+    /* with a body force the equilibrium is at the velocity half a
+    ** step of the force on */
+    if (force != 0.0f) u_x += 0.5f * force / local_density;
+
+    /* zero velocity density: weight w0 */
+    d_equ[0] = w0 * local_density * (1.0f - (u_x * u_x + u_y * u_y) * 1.5f);
+    /* axis speeds: weight w1 */
+    d_equ[1] = w1 * local_density * (u_x * (3.0f * u_x + 3.0f) - 1.5f * u_y * u_y + 1.0f);
+    d_equ[2] = w1 * local_density * (-1.5f * u_x * u_x + u_y * (3.0f * u_y + 3.0f) + 1.0f);
+    d_equ[3] = w1 * local_density * (u_x * (3.0f * u_x - 3.0f) - 1.5f * u_y * u_y + 1.0f);
+    d_equ[4] = w1 * local_density * (-1.5f * u_x * u_x + u_y * (3.0f * u_y - 3.0f) + 1.0f);
+    /* diagonal speeds: weight w2 */
+    d_equ[5] = w2 * local_density * (u_x * (3.0f * u_x + 9.0f * u_y + 3.0f) + u_y * (3.0f * u_y + 3.0f) + 1.0f);
+    d_equ[6] = w2 * local_density * (u_y * (-9.0f * u_x + 3.0f * u_y + 3.0f) + u_x * (3.0f * u_x - 3.0f) + 1.0f);
+    d_equ[7] = w2 * local_density * (u_x * (3.0f * u_x + 9.0f * u_y - 3.0f) + u_y * (3.0f * u_y - 3.0f) + 1.0f);
+    d_equ[8] = w2 * local_density * (u_y * (-9.0f * u_x + 3.0f * u_y - 3.0f) + u_x * (3.0f * u_x + 3.0f) + 1.0f);
+
+    /* relaxation step */
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      out[jj].speeds[kk] = in[jj].speeds[kk] + omega * (d_equ[kk] - in[jj].speeds[kk]);
+    }
+    /* Guo's forcing term, (1 - omega / 2) w_k (3 (e_k - u) + 9 (e_k . u) e_k) . F,
+    ** for a force (force, 0) */
+    if (force != 0.0f)
+    {
+      out[jj].speeds[0] += force_w * w0 * (-3.0f * u_x);
+      out[jj].speeds[1] += force_w * w1 * (3.0f + 6.0f * u_x);
+      out[jj].speeds[2] += force_w * w1 * (-3.0f * u_x);
+      out[jj].speeds[3] += force_w * w1 * (-3.0f + 6.0f * u_x);
+      out[jj].speeds[4] += force_w * w1 * (-3.0f * u_x);
+      out[jj].speeds[5] += force_w * w2 * (3.0f + 6.0f * u_x + 9.0f * u_y);
+      out[jj].speeds[6] += force_w * w2 * (-3.0f + 6.0f * u_x - 9.0f * u_y);
+      out[jj].speeds[7] += force_w * w2 * (-3.0f + 6.0f * u_x + 9.0f * u_y);
+      out[jj].speeds[8] += force_w * w2 * (3.0f + 6.0f * u_x - 9.0f * u_y);
+    }
+  }
+}
+
+/* the bounce-back of n blocked cells: called after propagate, so taking
+** values from scratch space, mirroring, and writing into out; the rest
+** density is unchanged, and whole cells are written */
+static inline void bounce_back(t_speed* out, const t_speed_temp* in, int n)
+{
+  for (int jj = 0; jj < n; jj++)
+  {
+    out[jj].speeds[0] = in[jj].speeds[0];
+    out[jj].speeds[1] = in[jj].speeds[3];
+    out[jj].speeds[2] = in[jj].speeds[4];
+    out[jj].speeds[3] = in[jj].speeds[1];
+    out[jj].speeds[4] = in[jj].speeds[2];
+    out[jj].speeds[5] = in[jj].speeds[7];
+    out[jj].speeds[6] = in[jj].speeds[8];
+    out[jj].speeds[7] = in[jj].speeds[5];
+    out[jj].speeds[8] = in[jj].speeds[6];
+  }
+}
+
+static void rebound_and_collision(d2q9_sim* sim)
+{
+  const t_param params = sim->params;
+  const int tiles_x = sim->tiles_x;
+  t_speed* cells = sim->cells;
+  const t_speed_temp* tmp_cells = sim->tmp_cells;
+  const t_run* runs = sim->runs;
+  const int* seg_runs = sim->seg_runs;
+  const int stream_stores = sim->stream_stores;
+  const float force = sim->body_force;
+
+  /* loop over the cells in runs, with the collision on the non-blocked
+  ** runs and the bounce-back on the blocked ones
+  ** NB the collision step is called after
+  ** the propagate step and so values of interest
+  ** are in the scratch-space grid */
+#pragma omp parallel num_threads(sim->nthreads)
+  {
+    /* with streaming stores, each chunk of a row is computed here and then
+    ** streamed to cells in whole lines, skipping the read for ownership */
+    t_speed chunk[STREAM_CHUNK] __attribute__((aligned(64)));
+
+    phase_begin(PHASE_COLLISION);
+#pragma omp for nowait
+    for (int tt = 0; tt < sim->bands * tiles_x; tt++)
+    {
+      int tx, ii0, ii1, jj0, jj1;
+
+      tile_bounds(sim, tt, &tx, &ii0, &ii1, &jj0, &jj1);
+
+      for (int ii = ii0; ii < ii1; ii++)
+      {
+        const size_t base = seg_base(sim, ii, tx);
+        const int seg = ii * tiles_x + tx;
+        int rr = seg_runs[seg];
+
+        /* the row is chunked across its runs, so that short runs do not
+        ** each cost partial lines; only the ends of a stretch of runs next
+        ** to cells in no run can be */
+        while (rr < seg_runs[seg + 1])
+        {
+          int stretch_end = rr + 1;
+
+          while (stretch_end < seg_runs[seg + 1] && runs[stretch_end].start == runs[stretch_end - 1].end)
+          {
+            stretch_end++;
+          }
+
+          for (int j0 = runs[rr].start; j0 < runs[stretch_end - 1].end; j0 += STREAM_CHUNK)
+          {
+            const int j1 = j0 + STREAM_CHUNK < runs[stretch_end - 1].end ? j0 + STREAM_CHUNK
+                         : runs[stretch_end - 1].end;
+            t_speed* out = stream_stores ? chunk : &cells[base + j0];
+
+            /* the parts of the runs in this chunk; a run which goes on into
+            ** the next chunk is left for it */
+            while (rr < stretch_end && runs[rr].start < j1)
+            {
+              const int start = runs[rr].start > j0 ? runs[rr].start : j0;
+              int last = rr;
+
+              /* edge and bulk runs only differ to propagate(), so the
+              ** collision takes neighbouring ones in one go */
+              if (runs[rr].kind != RUN_WALL)
+              {
+                while (last + 1 < stretch_end && runs[last + 1].kind != RUN_WALL && runs[last + 1].start < j1) last++;
+              }
+
+              const int end = runs[last].end < j1 ? runs[last].end : j1;
+
+              if (runs[rr].kind != RUN_WALL)
+                collide(&out[start - j0], &tmp_cells[base + start], end - start, params.omega, force);
+              else
+                bounce_back(&out[start - j0], &tmp_cells[base + start], end - start);
+
+              rr = last;
+              if (runs[rr].end > j1) break;
+              rr++;
+            }
+
+            if (stream_stores) stream_copy(cells[base + j0].speeds, chunk[0].speeds, (j1 - j0) * NSPEEDS);
+          }
+        }
+      }
+    }
+
+    /* order the streaming stores before the barrier */
+    if (stream_stores) _mm_sfence();
+    phase_end(PHASE_COLLISION);
+    phase_barrier();
+  }
+}
+
+static long llc_size(void)
+{
+  long  size = 0;
+  char  unit = 'B';
+  FILE* fp;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (size > 0) return size;
+#endif
+
+  fp = fopen("/sys/devices/system/cpu/cpu0/cache/index3/size", "r");
+
+  if (fp == NULL) return 0;
+
+  if (fscanf(fp, "%ld%c", &size, &unit) < 1) size = 0;
+  fclose(fp);
+
+  if (unit == 'K') size *= 1024;
+  else if (unit == 'M') size *= 1024 * 1024;
+
+  return size;
+}
+
+static inline void stream_copy(float* dst, const float* src, int n)
+{
+  int ii = 0;
+  int bits;
+
+  /* MOVNTI single floats up to a 16 byte boundary, then MOVNTPS */
+  for (; ii < n && ((uintptr_t)(dst + ii) & 15); ii++)
+  {
+    memcpy(&bits, &src[ii], sizeof(int));
+    _mm_stream_si32((int*)&dst[ii], bits);
+  }
+
+  for (; ii + 4 <= n; ii += 4)
+  {
+    _mm_stream_ps(&dst[ii], _mm_loadu_ps(&src[ii]));
+  }
+
+  for (; ii < n; ii++)
+  {
+    memcpy(&bits, &src[ii], sizeof(int));
+    _mm_stream_si32((int*)&dst[ii], bits);
+  }
+}
+
+static float av_velocity(const d2q9_sim* sim, float* prev_u, float* change)
+{
+  const t_param params = sim->params;
+  const int tiles_x = sim->tiles_x;
+  const t_speed* cells = sim->cells;
+  const t_run* runs = sim->runs;
+  const int* seg_runs = sim->seg_runs;
+  const float half_force = 0.5f * sim->body_force;
+  float* row_sums = sim->row_sums;
+  double tot_u = 0.0;   /* accumulated magnitudes of velocity for each cell */
+  double tot_du2 = 0.0; /* accumulated squared change in velocity */
+  double tot_u2 = 0.0;  /* accumulated squared velocity */
+
+  /* each row is summed by one thread, left to right, and the rows are
+  ** added up in order afterwards, so that the result is the same for any
+  ** number of threads */
+#pragma omp parallel num_threads(sim->nthreads)
+  {
+    phase_begin(PHASE_AV_VELOCITY);
+    /* loop over all non-blocked cells */
+#pragma omp for nowait
+    for (int ii = 0; ii < params.ny; ii++)
+    {
+      float row_u = 0.0f;
+      float row_du2 = 0.0f;
+      float row_u2 = 0.0f;
+
+      /* the non-blocked runs, left to right */
+      for (int tx = 0; tx < tiles_x; tx++)
+      {
+        const t_speed* row = &cells[seg_base(sim, ii, tx)];
+        const int seg = ii * tiles_x + tx;
+
+        for (int rr = seg_runs[seg]; rr < seg_runs[seg + 1]; rr++)
+        {
+          if (runs[rr].kind == RUN_WALL) continue;
+
+          for (int jj = runs[rr].start; jj < runs[rr].end; jj++)
+          {
+            /* local density total, summed in order like the ensemble kernel */
+            float local_density = 0.0f;
+            for (int kk = 0; kk < NSPEEDS; kk++)
+            {
+              local_density += row[jj].speeds[kk];
+            }
+
+            /* x-component of velocity */
+            float u_x = (row[jj].speeds[1]
+                          + row[jj].speeds[5]
+                          + row[jj].speeds[8]
+                          - (row[jj].speeds[3]
+                             + row[jj].speeds[6]
+                             + row[jj].speeds[7]))
+                         / local_density;
+            /* the velocity includes half a step of any body force */
+            if (half_force != 0.0f) u_x += half_force / local_density;
+            /* compute y velocity component */
+            float u_y = (row[jj].speeds[2]
+                          + row[jj].speeds[5]
+                          + row[jj].speeds[6]
+                          - (row[jj].speeds[4]
+                             + row[jj].speeds[7]
+                             + row[jj].speeds[8]))
+                         / local_density;
+            /* accumulate the norm of x- and y- velocity components */
+            row_u += fast_sqrt((float) ((u_x * u_x) + (u_y * u_y)));
+
+            if (prev_u != NULL)
+            {
+              float* prev = &prev_u[2 * (ii * params.nx + jj)];
+              const float du_x = u_x - prev[0];
+              const float du_y = u_y - prev[1];
+
+              row_du2 += du_x * du_x + du_y * du_y;
+              row_u2 += u_x * u_x + u_y * u_y;
+              prev[0] = u_x;
+              prev[1] = u_y;
+            }
+          }
+        }
+      }
+
+      row_sums[3 * ii] = row_u;
+      row_sums[3 * ii + 1] = row_du2;
+      row_sums[3 * ii + 2] = row_u2;
+    }
+    phase_end(PHASE_AV_VELOCITY);
+    phase_barrier();
+  }
+
+  for (int ii = 0; ii < params.ny; ii++)
+  {
+    tot_u += row_sums[3 * ii];
+    tot_du2 += row_sums[3 * ii + 1];
+    tot_u2 += row_sums[3 * ii + 2];
+  }
+
+  if (prev_u != NULL)
+  {
+    *change = tot_u2 > 0.0 ? (float)sqrt(tot_du2 / tot_u2) : 0.0f;
+  }
+
+  return (float)(tot_u / sim->tot_cells);
+}
+
+float d2q9_av_velocity(const d2q9_sim* sim)
+{
+  return av_velocity(sim, NULL, NULL);
+}
+
+float d2q9_reynolds(const d2q9_sim* sim)
+{
+  const float viscosity = 1.0f / 6.0f * (2.0f / sim->params.omega - 1.0f);
+
+  return av_velocity(sim, NULL, NULL) * sim->params.reynolds_dim / viscosity;
+}
+
+float d2q9_total_density(const d2q9_sim* sim)
+{
+  const t_param params = sim->params;
+  const t_speed* cells = sim->cells;
+  const int* obstacles = sim->obstacles;
+  double total = 0.0;  /* accumulator */
+
+  /* in double, as a float sum of nx * ny * 9 terms loses digits; blocked
+  ** cells are left out, so the sum drifts, see d2q9.h */
+  for (int ii = 0; ii < params.ny; ii++)
+  {
+    for (int jj = 0; jj < params.nx; jj++)
+    {
+      if (obstacles[cell_index(sim, ii, jj)]) continue;
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        total += cells[cell_index(sim, ii, jj)].speeds[kk];
+      }
+    }
+  }
+
+  return (float)total;
+}
+
+int d2q9_get_fields(const d2q9_sim* sim, float* u_x_out, float* u_y_out, float* u_out, float* pressure_out)
+{
+  const t_param params = sim->params;
+  const t_speed* cells = sim->cells;
+  const int* obstacles = sim->obstacles;
+  const float c_sq = 1.0f / 3.0f; /* sq. of speed of sound */
+  const float half_force = 0.5f * sim->body_force;
+
+#pragma omp parallel for num_threads(sim->nthreads)
+  for (int ii = 0; ii < params.ny; ii++)
+  {
+    for (int jj = 0; jj < params.nx; jj++)
+    {
+      float local_density;         /* per grid cell sum of densities */
+      float pressure;              /* fluid pressure in grid cell */
+      float u_x;                   /* x-component of velocity in grid cell */
+      float u_y;                   /* y-component of velocity in grid cell */
+      float u;                     /* norm--root of summed squares--of u_x and u_y */
+      const size_t cell = cell_index(sim, ii, jj);
+
+      /* an occupied cell */
+      if (obstacles[cell])
+      {
+        u_x = u_y = u = 0.0;
+        pressure = params.density * c_sq;
+      }
+      /* no obstacle */
+      else
+      {
+        local_density = 0.0;
+
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          local_density += cells[cell].speeds[kk];
+        }
+
+        /* compute x velocity component */
+        u_x = (cells[cell].speeds[1]
+               + cells[cell].speeds[5]
+               + cells[cell].speeds[8]
+               - (cells[cell].speeds[3]
+                  + cells[cell].speeds[6]
+                  + cells[cell].speeds[7]))
+              / local_density;
+        if (half_force != 0.0f) u_x += half_force / local_density;
+        /* compute y velocity component */
+        u_y = (cells[cell].speeds[2]
+               + cells[cell].speeds[5]
+               + cells[cell].speeds[6]
+               - (cells[cell].speeds[4]
+                  + cells[cell].speeds[7]
+                  + cells[cell].speeds[8]))
+              / local_density;
+        /* compute norm of velocity */
+        u = fast_sqrt((float)((u_x * u_x) + (u_y * u_y)));
+        /* compute pressure */
+        pressure = local_density * c_sq;
+      }
+
+      if (u_x_out != NULL) u_x_out[ii * params.nx + jj] = u_x;
+      if (u_y_out != NULL) u_y_out[ii * params.nx + jj] = u_y;
+      if (u_out != NULL) u_out[ii * params.nx + jj] = u;
+      if (pressure_out != NULL) pressure_out[ii * params.nx + jj] = pressure;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int d2q9_set_fields(d2q9_sim* sim, const float* u_x_in, const float* u_y_in, const float* pressure_in)
+{
+  const t_param params = sim->params;
+  t_speed* cells = sim->cells;
+  const int* obstacles = sim->obstacles;
+  const float c_sq = 1.0f / 3.0f; /* sq. of speed of sound */
+  static const float w0 = 4.0f / 9.0f;  /* weighting factor */
+  static const float w1 = 1.0f / 9.0f;  /* weighting factor */
+  static const float w2 = 1.0f / 36.0f; /* weighting factor */
+
+#pragma omp parallel for num_threads(sim->nthreads)
+  for (int ii = 0; ii < params.ny; ii++)
+  {
+    for (int jj = 0; jj < params.nx; jj++)
+    {
+      const int in = ii * params.nx + jj;
+      const size_t cell = cell_index(sim, ii, jj);
+      /* blocked cells only ever hold bounced back values, start them at rest */
+      const float u_x = obstacles[cell] ? 0.0f : u_x_in[in];
+      const float u_y = obstacles[cell] ? 0.0f : u_y_in[in];
+      const float local_density = obstacles[cell] ? params.density : pressure_in[in] / c_sq;
+
+      /* the equilibrium distribution, as in rebound_and_collision() */
+      cells[cell].speeds[0] = w0 * local_density * (1.0f - (u_x * u_x + u_y * u_y) * 1.5f);
+      cells[cell].speeds[1] = w1 * local_density * (u_x * (3.0f * u_x + 3.0f) - 1.5f * u_y * u_y + 1.0f);
+      cells[cell].speeds[2] = w1 * local_density * (-1.5f * u_x * u_x + u_y * (3.0f * u_y + 3.0f) + 1.0f);
+      cells[cell].speeds[3] = w1 * local_density * (u_x * (3.0f * u_x - 3.0f) - 1.5f * u_y * u_y + 1.0f);
+      cells[cell].speeds[4] = w1 * local_density * (-1.5f * u_x * u_x + u_y * (3.0f * u_y - 3.0f) + 1.0f);
+      cells[cell].speeds[5] = w2 * local_density * (u_x * (3.0f * u_x + 9.0f * u_y + 3.0f) + u_y * (3.0f * u_y + 3.0f) + 1.0f);
+      cells[cell].speeds[6] = w2 * local_density * (u_y * (-9.0f * u_x + 3.0f * u_y + 3.0f) + u_x * (3.0f * u_x - 3.0f) + 1.0f);
+      cells[cell].speeds[7] = w2 * local_density * (u_x * (3.0f * u_x + 9.0f * u_y - 3.0f) + u_y * (3.0f * u_y - 3.0f) + 1.0f);
+      cells[cell].speeds[8] = w2 * local_density * (u_y * (-9.0f * u_x + 3.0f * u_y - 3.0f) + u_x * (3.0f * u_x + 3.0f) + 1.0f);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int d2q9_save_state(const d2q9_sim* sim, const char* filename)
+{
+  char   message[1024];  /* message buffer */
+  t_state_header header;
+  FILE*  fp;             /* file pointer */
+  int    ok;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+  header.nx = sim->params.nx;
+  header.ny = sim->params.ny;
+  header.nspeeds = NSPEEDS;
+  header.float_size = sizeof(float);
+
+  fp = fopen(filename, "wb");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open state file: %s", filename);
+    d2q9_error(message, __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+  /* by rows and without the padding, so the file does not depend on the
+  ** pitch or the tiles */
+  for (int ii = 0; ii < sim->params.ny && ok; ii++)
+  {
+    for (int jj = 0; jj < sim->params.nx && ok; jj += sim->pitch)
+    {
+      const size_t n = jj + sim->pitch < sim->params.nx ? sim->pitch : sim->params.nx - jj;
+
+      ok = fwrite(&sim->cells[cell_index(sim, ii, jj)], sizeof(t_speed), n, fp) == n;
+    }
+  }
+
+  if (fclose(fp) != 0) ok = 0;
+
+  if (!ok)
+  {
+    sprintf(message, "could not write state file: %s", filename);
+    d2q9_error(message, __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int d2q9_load_state(d2q9_sim* sim, const char* filename)
+{
+  char   message[1024];  /* message buffer */
+  t_state_header header;
+  FILE*  fp;             /* file pointer */
+  const char* problem = NULL; /* first error found in the file */
+
+  fp = fopen(filename, "rb");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open state file: %s", filename);
+    d2q9_error(message, __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  /* read into the grid only once the header matches */
+  if (fread(&header, sizeof(header), 1, fp) != 1) problem = "could not read state file header";
+  else if (memcmp(header.magic, STATE_MAGIC, sizeof(header.magic))) problem = "not a d2q9 state file";
+  else if (header.nspeeds != NSPEEDS || header.float_size != sizeof(float)) problem = "state file has an incompatible layout";
+  else if (header.nx != sim->params.nx || header.ny != sim->params.ny) problem = "state file grid size does not match the parameters";
+  else
+  {
+    for (int ii = 0; ii < sim->params.ny && problem == NULL; ii++)
+    {
+      for (int jj = 0; jj < sim->params.nx && problem == NULL; jj += sim->pitch)
+      {
+        const size_t n = jj + sim->pitch < sim->params.nx ? sim->pitch : sim->params.nx - jj;
+
+        if (fread(&sim->cells[cell_index(sim, ii, jj)], sizeof(t_speed), n, fp) != n)
+          problem = "state file is truncated";
+      }
+    }
+  }
+
+  fclose(fp);
+
+  if (problem != NULL)
+  {
+    sprintf(message, "%s: %s", problem, filename);
+    d2q9_error(message, __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void d2q9_destroy(d2q9_sim* sim)
+{
+  if (sim == NULL) return;
+
+  /*
+  ** free up allocated memory
+  */
+  arena_destroy(&sim->arena);
+  free(sim->prev_u);
+  free(sim);
+}
+
+void d2q9_error(const char* message, const int line, const char* file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n", message);
+  fflush(stderr);
+}
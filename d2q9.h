@@ -0,0 +1,211 @@
+/*
+** libd2q9: embeddable d2q9-bgk lattice Boltzmann solver.
+**
+** A simulation is held behind an opaque handle, so several can be
+** driven from the same program; the solver itself keeps no global
+** state. The exception is the optional kernel instrumentation of
+** instrument.h: its hardware counters and phase trace are process-wide,
+** off unless perf_counters_init() or trace_init() is called, and
+** attribute the phases of every running simulation to the same tables.
+**
+** Typical use:
+**
+**   t_param params;
+**   d2q9_read_params("input_128x128.params", &params);
+**   int* obstacles = malloc(sizeof(int) * params.nx * params.ny);
+**   d2q9_read_obstacles("obstacles_128x128.dat", &params, obstacles);
+**
+**   d2q9_sim* sim = d2q9_create(&params, obstacles);
+**   d2q9_step(sim, params.maxIters, av_vels);
+**   d2q9_get_fields(sim, u_x, u_y, NULL, NULL);
+**   d2q9_destroy(sim);
+**
+** Field buffers are nx * ny floats in row major order, i.e. cell
+** (jj, ii) is element ii * nx + jj, the same order as the obstacle map
+** and final_state.dat.
+**
+** Functions returning int return EXIT_SUCCESS or EXIT_FAILURE, and
+** functions returning a pointer return NULL on failure; in both cases a
+** message is printed on stderr. The library never exits the process.
+*/
+
+#ifndef D2Q9_H
+#define D2Q9_H
+
+/* struct to hold the parameter values */
+typedef struct
+{
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    maxIters;      /* no. of iterations */
+  int    reynolds_dim;  /* dimension for Reynolds number */
+  float density;       /* density per link */
+  float accel;         /* density redistribution */
+  float omega;         /* relaxation parameter */
+} t_param;
+
+/* opaque simulation handle */
+typedef struct d2q9_sim d2q9_sim;
+
+/* how the lattice buffers are backed by memory pages */
+enum
+{
+  D2Q9_PAGES_AUTO,      /* transparent huge pages asked for, if the grid fills one */
+  D2Q9_PAGES_SMALL,     /* base pages only */
+  D2Q9_PAGES_HUGETLB    /* explicit huge pages (MAP_HUGETLB), else as AUTO */
+};
+
+/* whether the collision writes the lattice with non-temporal stores */
+enum
+{
+  D2Q9_STREAM_AUTO,     /* when the grids are larger than the last level cache */
+  D2Q9_STREAM_OFF,
+  D2Q9_STREAM_ON
+};
+
+/* how the flow is driven */
+enum
+{
+  D2Q9_FORCE_ROW,       /* accelerate the second row from the top each step */
+  D2Q9_FORCE_BODY       /* a body force on every fluid cell (Guo forcing),
+                        ** putting in the same momentum per step */
+};
+
+/* settings fixed when a simulation is created */
+typedef struct
+{
+  int pages;            /* D2Q9_PAGES_* */
+  int row_pitch;        /* cells per stored row, >= nx; 0 picks one which
+                        ** avoids 4 KiB aliasing between nearby rows */
+  int streaming_stores; /* D2Q9_STREAM_* */
+  int forcing;          /* D2Q9_FORCE_* */
+  int tile;             /* 0 to store the grids by rows, or the edge in cells
+                        ** of the square tiles to store them in instead;
+                        ** row_pitch must then be 0 */
+} d2q9_options;
+
+/* read a parameter file into *params */
+int d2q9_read_params(const char* paramfile, t_param* params);
+
+/* read an obstacle file into obstacles[nx * ny], which is cleared first */
+int d2q9_read_obstacles(const char* obstaclefile, const t_param* params, int* obstacles);
+
+/* allocate a simulation and initialise it to the uniform equilibrium
+** distribution; params and obstacles[nx * ny] are copied */
+d2q9_sim* d2q9_create(const t_param* params, const int* obstacles);
+
+/* as d2q9_create() with options other than the defaults, which
+** d2q9_default_options() fills in */
+void d2q9_default_options(d2q9_options* options);
+d2q9_sim* d2q9_create_with_options(const t_param* params, const int* obstacles,
+                                   const d2q9_options* options);
+
+/* start sim over from the uniform equilibrium with other params and
+** obstacles of the same grid size, keeping its buffers, options and
+** settings; EXIT_FAILURE if nx or ny differ */
+int d2q9_reset(d2q9_sim* sim, const t_param* params, const int* obstacles);
+
+/* page size in bytes backing the lattice buffers, after any fallback; with
+** transparent huge pages this is the huge page size once the kernel has
+** used them for any of the buffers */
+long d2q9_page_size(const d2q9_sim* sim);
+
+/* cells per stored row of the lattice buffers */
+int d2q9_row_pitch(const d2q9_sim* sim);
+
+/* edge of the tiles the lattice buffers are stored in, 0 if by rows */
+int d2q9_tile(const d2q9_sim* sim);
+
+/* the x component of the body force on each fluid cell, 0 unless the
+** simulation was created with D2Q9_FORCE_BODY */
+float d2q9_body_force(const d2q9_sim* sim);
+
+/* non-zero if the collision uses non-temporal stores */
+int d2q9_streaming_stores(const d2q9_sim* sim);
+
+/* advance nsteps timesteps; if av_vels is not NULL the average velocity
+** after each step is stored in av_vels[0 .. nsteps - 1] */
+void d2q9_step(d2q9_sim* sim, int nsteps, float* av_vels);
+
+/* number of OpenMP threads used by the kernels of this simulation, from
+** the calling thread; 0 restores the default, omp_get_max_threads() at
+** the time of the call */
+void d2q9_set_threads(d2q9_sim* sim, int nthreads);
+int d2q9_threads(const d2q9_sim* sim);
+
+/* software prefetch distance of the streaming step, in cells ahead along
+** the rows read; 0 (the default) leaves it to the hardware prefetchers */
+void d2q9_set_prefetch(d2q9_sim* sim, int distance);
+int d2q9_prefetch(const d2q9_sim* sim);
+
+/* with enable non-zero, each step also computes the relative L2 norm of
+** the change in velocity, sqrt(sum |u - u_prev|^2 / sum |u|^2) over the
+** non-blocked cells, at the cost of two floats of state per cell */
+int d2q9_track_velocity_change(d2q9_sim* sim, int enable);
+
+/* the norm after the last step, or -1 if it is not being tracked */
+float d2q9_velocity_change(const d2q9_sim* sim);
+
+/* number of timesteps taken since d2q9_create() */
+int d2q9_iterations(const d2q9_sim* sim);
+
+const t_param* d2q9_params(const d2q9_sim* sim);
+
+/* macroscopic fields, as written to final_state.dat: velocity components,
+** velocity norm and pressure. Any of the buffers may be NULL. Blocked
+** cells have zero velocity and the reference pressure. */
+int d2q9_get_fields(const d2q9_sim* sim, float* u_x, float* u_y, float* u, float* pressure);
+
+/* replace the distributions by the equilibrium for the given macroscopic
+** fields, e.g. as read from final_state.dat (density is pressure / c_sq);
+** blocked cells are set to rest at the parameter file density */
+int d2q9_set_fields(d2q9_sim* sim, const float* u_x, const float* u_y, const float* pressure);
+
+/* write the distributions to a binary file which d2q9_load_state() can read
+** into a simulation of the same grid size, whatever its accel and omega.
+** The file is in native byte order. */
+int d2q9_save_state(const d2q9_sim* sim, const char* filename);
+int d2q9_load_state(d2q9_sim* sim, const char* filename);
+
+/* average velocity over non-blocked cells */
+float d2q9_av_velocity(const d2q9_sim* sim);
+
+/* Reynolds number of the current state */
+float d2q9_reynolds(const d2q9_sim* sim);
+
+/* sum of the densities of the non-blocked cells, a diagnostic rather
+** than a conservation check: it drifts from step to step, as mass in
+** transit sits in the bounced-back values of blocked cells, and blocked
+** cells at the edge of a solid region exchange values with cells that are
+** never updated, see "Obstacle runs" in the README */
+float d2q9_total_density(const d2q9_sim* sim);
+
+/* free everything allocated by d2q9_create() */
+void d2q9_destroy(d2q9_sim* sim);
+
+/*
+** Ensembles: nmembers simulations sharing params (apart from accel and
+** omega, which are given per member) and the obstacle map, stored with
+** the member as the innermost dimension so that one timestep advances
+** them all with SIMD instructions.
+*/
+typedef struct d2q9_ensemble d2q9_ensemble;
+
+d2q9_ensemble* d2q9_ensemble_create(const t_param* params, const int* obstacles,
+                                    int nmembers, const float* accel, const float* omega);
+
+int d2q9_ensemble_size(const d2q9_ensemble* ens);
+
+/* advance nsteps timesteps; if av_vels is not NULL the average velocity of
+** member mm after step tt is stored in av_vels[tt * nmembers + mm] */
+void d2q9_ensemble_step(d2q9_ensemble* ens, int nsteps, float* av_vels);
+
+/* as d2q9_get_fields() and d2q9_reynolds() for one member */
+int d2q9_ensemble_get_fields(const d2q9_ensemble* ens, int member,
+                             float* u_x, float* u_y, float* u, float* pressure);
+float d2q9_ensemble_reynolds(const d2q9_ensemble* ens, int member);
+long d2q9_ensemble_page_size(const d2q9_ensemble* ens);
+
+void d2q9_ensemble_destroy(d2q9_ensemble* ens);
+
+#endif
@@ -0,0 +1,69 @@
+/*
+** Definitions shared by the source files of libd2q9.
+** These are not part of the library interface in d2q9.h.
+*/
+
+#ifndef D2Q9_INTERNAL_H
+#define D2Q9_INTERNAL_H
+
+#include <stddef.h>
+#include <xmmintrin.h>
+
+#define NSPEEDS         9
+
+#ifndef ARENA_ALIGN
+#define ARENA_ALIGN     64  /* a cache line, and one AVX-512 vector */
+#endif
+
+/* report an error on stderr without leaving the caller's process */
+void d2q9_error(const char* message, const int line, const char* file);
+
+/*
+** One mapping holding all the buffers of a simulation, see arena.c.
+** Buffers are never freed on their own, only the whole arena.
+*/
+typedef struct
+{
+  char*  base;            /* ARENA_ALIGN aligned start of the buffers */
+  size_t size;            /* bytes available from base */
+  size_t used;            /* bytes handed out */
+  char*  map;             /* the mapping, NULL if base came from posix_memalign() */
+  size_t map_size;
+  int    pages;           /* D2Q9_PAGES_* obtained, after any fallback */
+  long   huge_page_size;
+  long   base_page_size;
+} t_arena;
+
+/* bytes that arena_alloc(size) takes, for sizing an arena up front */
+size_t arena_size(size_t size);
+
+/* map size bytes according to a D2Q9_PAGES_* policy; the memory is zeroed */
+int arena_create(t_arena* arena, size_t size, int pages);
+
+/* the next ARENA_ALIGN aligned size bytes, NULL if the arena is full */
+void* arena_alloc(t_arena* arena, size_t size);
+
+/* cells per stored row of buffers with rows of nx elements of each of the
+** nsizes sizes in elem_sizes, chosen so that rows one and two apart are
+** not 4 KiB aliased in any of them; nx if nothing close by qualifies */
+int arena_row_pitch(int nx, const size_t* elem_sizes, int nsizes);
+
+/* the page size backing the buffers handed out so far */
+long arena_page_size(const t_arena* arena);
+
+void arena_destroy(t_arena* arena);
+
+static inline float fast_sqrt(float fIn) {
+  if (fIn == 0) { return 0.0f; }
+  float fOut;
+  _mm_store_ss(&fOut, _mm_mul_ss(_mm_load_ss(&fIn), _mm_rsqrt_ss(_mm_load_ss( &fIn ))));
+  return fOut;
+}
+
+/* fast_sqrt() of four floats, giving the same result in each lane */
+static inline __m128 fast_sqrt4(__m128 fIn) {
+  const __m128 root = _mm_mul_ps(fIn, _mm_rsqrt_ps(fIn));
+  return _mm_and_ps(root, _mm_cmpneq_ps(fIn, _mm_setzero_ps()));
+}
+
+#endif
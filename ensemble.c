@@ -0,0 +1,465 @@
+/*
+** Ensemble mode: many simulations with their own accel and omega on one
+** geometry, advanced together by each timestep.
+**
+** The innermost dimension of the lattice is the ensemble member, so the
+** density of speed kk in cell (jj, ii) for member mm is
+**
+**   cells[((ii * pitch + jj) * NSPEEDS + kk) * width + mm]
+**
+** and the loop over members in each kernel is a unit stride SIMD loop in
+** which every lane does identical work. The member count is rounded up to
+** width, a multiple of ENSEMBLE_WIDTH floats (8, one AVX register; build
+** with -DENSEMBLE_WIDTH=16 for AVX-512). Padding lanes repeat the last
+** member's parameters and are never reported. The obstacle map is shared.
+** Rows are pitch >= nx cells apart, padded as for a single simulation to
+** keep neighbouring rows from aliasing.
+**
+** Each timestep is one parallel region: accelerate_flow() on row ny - 2,
+** then a fused propagate/rebound/collision which pulls from cells into
+** next_cells and also accumulates the per-row sums of the velocity norm
+** for av_velocity(), after which the two grids are swapped.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<math.h>
+#include <omp.h>
+
+#include "d2q9.h"
+#include "d2q9_internal.h"
+#include "instrument.h"
+
+#ifndef ENSEMBLE_WIDTH
+#define ENSEMBLE_WIDTH  8
+#endif
+
+/* the state of an ensemble of simulations */
+struct d2q9_ensemble
+{
+  t_param params;       /* shared parameter values, accel and omega of member 0 */
+  int     nmembers;     /* no. of simulations */
+  int     width;        /* nmembers rounded up to ENSEMBLE_WIDTH */
+  int     pitch;        /* cells per stored row, >= nx */
+  float*  cells;        /* grid containing fluid densities */
+  float*  next_cells;   /* grid written by the fused kernel */
+  int*    obstacles;    /* grid indicating which cells are blocked */
+  float*  omega;        /* [width] relaxation parameter of each member */
+  float*  accel_w1;     /* [width] accelerate_flow() weighting factors of each member */
+  float*  accel_w2;
+  float*  row_u;        /* [ny * width] per-row sums of the velocity norm */
+  t_arena arena;        /* holds all of the above */
+  int     tot_cells;    /* number of non-blocked cells */
+  int     iterations;   /* timesteps taken so far */
+};
+
+static void ensemble_timestep(d2q9_ensemble* ens, float* av_vels);
+
+d2q9_ensemble* d2q9_ensemble_create(const t_param* params, const int* obstacles,
+                                    int nmembers, const float* accel, const float* omega)
+{
+  d2q9_ensemble* ens;
+  size_t ncells;        /* cells stored per grid, including row padding */
+  size_t cell_size;     /* bytes of one cell of cells */
+
+  if (params->nx < 1 || params->ny < 3)
+  {
+    d2q9_error("grid must be at least 1x3 cells", __LINE__, __FILE__);
+    return NULL;
+  }
+
+  if (nmembers < 1)
+  {
+    d2q9_error("an ensemble needs at least one member", __LINE__, __FILE__);
+    return NULL;
+  }
+
+  ens = calloc(1, sizeof(d2q9_ensemble));
+
+  if (ens == NULL)
+  {
+    d2q9_error("cannot allocate memory for ensemble", __LINE__, __FILE__);
+    return NULL;
+  }
+
+  ens->params = *params;
+  ens->params.accel = accel[0];
+  ens->params.omega = omega[0];
+  ens->nmembers = nmembers;
+  ens->width = (nmembers + ENSEMBLE_WIDTH - 1) / ENSEMBLE_WIDTH * ENSEMBLE_WIDTH;
+
+  cell_size = sizeof(float) * NSPEEDS * ens->width;
+  ens->pitch = arena_row_pitch(params->nx, &cell_size, 1);
+  ncells = (size_t)ens->pitch * params->ny;
+
+  if (arena_create(&ens->arena, 2 * arena_size(sizeof(float) * ncells * NSPEEDS * ens->width)
+                   + arena_size(sizeof(int) * ncells) + 3 * arena_size(sizeof(float) * ens->width)
+                   + arena_size(sizeof(float) * params->ny * ens->width), D2Q9_PAGES_AUTO) != EXIT_SUCCESS)
+  {
+    d2q9_ensemble_destroy(ens);
+    return NULL;
+  }
+
+  ens->cells = arena_alloc(&ens->arena, sizeof(float) * ncells * NSPEEDS * ens->width);
+  ens->next_cells = arena_alloc(&ens->arena, sizeof(float) * ncells * NSPEEDS * ens->width);
+  ens->obstacles = arena_alloc(&ens->arena, sizeof(int) * ncells);
+  ens->omega = arena_alloc(&ens->arena, sizeof(float) * ens->width);
+  ens->accel_w1 = arena_alloc(&ens->arena, sizeof(float) * ens->width);
+  ens->accel_w2 = arena_alloc(&ens->arena, sizeof(float) * ens->width);
+  ens->row_u = arena_alloc(&ens->arena, sizeof(float) * params->ny * ens->width);
+
+  if (ens->cells == NULL || ens->next_cells == NULL || ens->obstacles == NULL
+      || ens->omega == NULL || ens->accel_w1 == NULL || ens->accel_w2 == NULL
+      || ens->row_u == NULL)
+  {
+    d2q9_error("cannot allocate memory for ensemble grids", __LINE__, __FILE__);
+    d2q9_ensemble_destroy(ens);
+    return NULL;
+  }
+
+  for (int mm = 0; mm < ens->width; mm++)
+  {
+    const int src = mm < nmembers ? mm : nmembers - 1;
+
+    ens->omega[mm] = omega[src];
+    ens->accel_w1[mm] = params->density * accel[src] / 9.0f;
+    ens->accel_w2[mm] = params->density * accel[src] / 36.0f;
+  }
+
+  for (int ii = 0; ii < params->ny; ii++)
+  {
+    for (int jj = 0; jj < params->nx; jj++)
+    {
+      ens->obstacles[ii * ens->pitch + jj] = obstacles[ii * params->nx + jj];
+      if (!obstacles[ii * params->nx + jj]) ens->tot_cells++;
+    }
+  }
+
+  /* initialise densities, in parallel so that pages are placed
+  ** near the threads which will work on them */
+  const float w[NSPEEDS] = {
+    params->density * 4.0f / 9.0f,
+    params->density / 9.0f, params->density / 9.0f,
+    params->density / 9.0f, params->density / 9.0f,
+    params->density / 36.0f, params->density / 36.0f,
+    params->density / 36.0f, params->density / 36.0f
+  };
+
+#pragma omp parallel for
+  for (int ii = 0; ii < params->ny; ii++)
+  {
+    for (int jj = 0; jj < params->nx; jj++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        float* c = ens->cells + ((size_t)(ii * ens->pitch + jj) * NSPEEDS + kk) * ens->width;
+        float* n = ens->next_cells + ((size_t)(ii * ens->pitch + jj) * NSPEEDS + kk) * ens->width;
+
+        for (int mm = 0; mm < ens->width; mm++)
+        {
+          c[mm] = w[kk];
+          n[mm] = w[kk];
+        }
+      }
+    }
+  }
+
+  return ens;
+}
+
+int d2q9_ensemble_size(const d2q9_ensemble* ens)
+{
+  return ens->nmembers;
+}
+
+void d2q9_ensemble_step(d2q9_ensemble* ens, int nsteps, float* av_vels)
+{
+  for (int tt = 0; tt < nsteps; tt++)
+  {
+    ensemble_timestep(ens, av_vels != NULL ? av_vels + (size_t)tt * ens->nmembers : NULL);
+    ens->iterations++;
+  }
+}
+
+static void ensemble_timestep(d2q9_ensemble* ens, float* av_vels)
+{
+  static const float w0 = 4.0f / 9.0f;  /* weighting factor */
+  static const float w1 = 1.0f / 9.0f;  /* weighting factor */
+  static const float w2 = 1.0f / 36.0f; /* weighting factor */
+  const int nx = ens->params.nx;
+  const int ny = ens->params.ny;
+  const int pitch = ens->pitch;
+  const int width = ens->width;
+  const int accelerate_flow_ii = ny - 2;
+  float* restrict cells = ens->cells;
+  float* restrict next_cells = ens->next_cells;
+  const int* restrict obstacles = ens->obstacles;
+  const float* restrict omega = ens->omega;
+  const float* restrict accel_w1 = ens->accel_w1;
+  const float* restrict accel_w2 = ens->accel_w2;
+  float* restrict row_u = ens->row_u;
+
+#pragma omp parallel
+  {
+    phase_begin(PHASE_ACCELERATE);
+#pragma omp for nowait
+    for (int jj = 0; jj < nx; jj++)
+    {
+      if (!obstacles[accelerate_flow_ii * pitch + jj])
+      {
+        float* c = cells + (size_t)(accelerate_flow_ii * pitch + jj) * NSPEEDS * width;
+
+        /* members whose densities would go negative are left alone */
+#pragma omp simd
+        for (int mm = 0; mm < width; mm++)
+        {
+          if ((c[3 * width + mm] - accel_w1[mm]) > 0.0f
+              && (c[6 * width + mm] - accel_w2[mm]) > 0.0f
+              && (c[7 * width + mm] - accel_w2[mm]) > 0.0f)
+          {
+            /* increase 'east-side' densities */
+            c[1 * width + mm] += accel_w1[mm];
+            c[5 * width + mm] += accel_w2[mm];
+            c[8 * width + mm] += accel_w2[mm];
+            /* decrease 'west-side' densities */
+            c[3 * width + mm] -= accel_w1[mm];
+            c[6 * width + mm] -= accel_w2[mm];
+            c[7 * width + mm] -= accel_w2[mm];
+          }
+        }
+      }
+    }
+    phase_end(PHASE_ACCELERATE);
+
+    /* the fused kernel reads the accelerated row from other threads' rows */
+    phase_sync();
+
+    phase_begin(PHASE_STREAM_COLLIDE);
+#pragma omp for nowait
+    for (int ii = 0; ii < ny; ii++)
+    {
+      /* determine indices of axis-direction neighbours
+      ** respecting periodic boundary conditions (wrap around) */
+      const int y_n = (ii + 1) % ny;
+      const int y_s = (ii == 0) ? (ii + ny - 1) : (ii - 1);
+      float* restrict u_sum = row_u + (size_t)ii * width;
+
+      for (int mm = 0; mm < width; mm++) u_sum[mm] = 0.0f;
+
+      for (int jj = 0; jj < nx; jj++)
+      {
+        const int x_e = (jj + 1) % nx;
+        const int x_w = (jj == 0) ? (jj + nx - 1) : (jj - 1);
+        /* the lanes of each speed, pulled from the neighbour it travels from */
+        const float* restrict s0 = cells + ((size_t)(ii  * pitch + jj ) * NSPEEDS + 0) * width;
+        const float* restrict s1 = cells + ((size_t)(ii  * pitch + x_w) * NSPEEDS + 1) * width;
+        const float* restrict s2 = cells + ((size_t)(y_s * pitch + jj ) * NSPEEDS + 2) * width;
+        const float* restrict s3 = cells + ((size_t)(ii  * pitch + x_e) * NSPEEDS + 3) * width;
+        const float* restrict s4 = cells + ((size_t)(y_n * pitch + jj ) * NSPEEDS + 4) * width;
+        const float* restrict s5 = cells + ((size_t)(y_s * pitch + x_w) * NSPEEDS + 5) * width;
+        const float* restrict s6 = cells + ((size_t)(y_s * pitch + x_e) * NSPEEDS + 6) * width;
+        const float* restrict s7 = cells + ((size_t)(y_n * pitch + x_e) * NSPEEDS + 7) * width;
+        const float* restrict s8 = cells + ((size_t)(y_n * pitch + x_w) * NSPEEDS + 8) * width;
+        float* restrict d = next_cells + (size_t)(ii * pitch + jj) * NSPEEDS * width;
+
+        if (obstacles[ii * pitch + jj])
+        {
+          /* rebound: mirror the pulled densities */
+#pragma omp simd
+          for (int mm = 0; mm < width; mm++)
+          {
+            d[0 * width + mm] = s0[mm];
+            d[1 * width + mm] = s3[mm];
+            d[2 * width + mm] = s4[mm];
+            d[3 * width + mm] = s1[mm];
+            d[4 * width + mm] = s2[mm];
+            d[5 * width + mm] = s7[mm];
+            d[6 * width + mm] = s8[mm];
+            d[7 * width + mm] = s5[mm];
+            d[8 * width + mm] = s6[mm];
+          }
+          continue;
+        }
+
+        for (int m0 = 0; m0 < width; m0 += ENSEMBLE_WIDTH)
+        {
+          /* squared speeds of a block of members, rooted as av_velocity() does */
+          float u2[ENSEMBLE_WIDTH];
+
+#pragma omp simd
+          for (int mm = m0; mm < m0 + ENSEMBLE_WIDTH; mm++)
+          {
+            const float f0 = s0[mm], f1 = s1[mm], f2 = s2[mm];
+            const float f3 = s3[mm], f4 = s4[mm], f5 = s5[mm];
+            const float f6 = s6[mm], f7 = s7[mm], f8 = s8[mm];
+
+            /* compute local density total */
+            const float local_density = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8;
+            /* compute x and y velocity components */
+            const float u_x = (f1 + f5 + f8 - (f3 + f6 + f7)) / local_density;
+            const float u_y = (f2 + f5 + f6 - (f4 + f7 + f8)) / local_density;
+            const float om = omega[mm];
+
+            /* equilibrium densities, relaxation step */
+            const float d0 = f0 + om * (w0 * local_density * (1.0f - (u_x * u_x + u_y * u_y) * 1.5f) - f0);
+            const float d1 = f1 + om * (w1 * local_density * (u_x * (3.0f * u_x + 3.0f) - 1.5f * u_y * u_y + 1.0f) - f1);
+            const float d2 = f2 + om * (w1 * local_density * (-1.5f * u_x * u_x + u_y * (3.0f * u_y + 3.0f) + 1.0f) - f2);
+            const float d3 = f3 + om * (w1 * local_density * (u_x * (3.0f * u_x - 3.0f) - 1.5f * u_y * u_y + 1.0f) - f3);
+            const float d4 = f4 + om * (w1 * local_density * (-1.5f * u_x * u_x + u_y * (3.0f * u_y - 3.0f) + 1.0f) - f4);
+            const float d5 = f5 + om * (w2 * local_density * (u_x * (3.0f * u_x + 9.0f * u_y + 3.0f) + u_y * (3.0f * u_y + 3.0f) + 1.0f) - f5);
+            const float d6 = f6 + om * (w2 * local_density * (u_y * (-9.0f * u_x + 3.0f * u_y + 3.0f) + u_x * (3.0f * u_x - 3.0f) + 1.0f) - f6);
+            const float d7 = f7 + om * (w2 * local_density * (u_x * (3.0f * u_x + 9.0f * u_y - 3.0f) + u_y * (3.0f * u_y - 3.0f) + 1.0f) - f7);
+            const float d8 = f8 + om * (w2 * local_density * (u_y * (-9.0f * u_x + 3.0f * u_y - 3.0f) + u_x * (3.0f * u_x + 3.0f) + 1.0f) - f8);
+
+            d[0 * width + mm] = d0;
+            d[1 * width + mm] = d1;
+            d[2 * width + mm] = d2;
+            d[3 * width + mm] = d3;
+            d[4 * width + mm] = d4;
+            d[5 * width + mm] = d5;
+            d[6 * width + mm] = d6;
+            d[7 * width + mm] = d7;
+            d[8 * width + mm] = d8;
+
+            /* velocity of the new state, for av_velocity() */
+            const float new_density = d0 + d1 + d2 + d3 + d4 + d5 + d6 + d7 + d8;
+            const float new_u_x = (d1 + d5 + d8 - (d3 + d6 + d7)) / new_density;
+            const float new_u_y = (d2 + d5 + d6 - (d4 + d7 + d8)) / new_density;
+
+            u2[mm - m0] = new_u_x * new_u_x + new_u_y * new_u_y;
+          }
+
+          for (int ll = 0; ll < ENSEMBLE_WIDTH; ll += 4)
+          {
+            _mm_storeu_ps(&u_sum[m0 + ll], _mm_add_ps(_mm_loadu_ps(&u_sum[m0 + ll]), fast_sqrt4(_mm_loadu_ps(&u2[ll]))));
+          }
+        }
+      }
+    }
+    phase_end(PHASE_STREAM_COLLIDE);
+    phase_barrier();
+  }
+
+  /* swap the grids */
+  ens->cells = next_cells;
+  ens->next_cells = cells;
+
+  if (av_vels != NULL)
+  {
+    /* sum the rows in a fixed order, in double as av_velocity() does */
+    for (int mm = 0; mm < ens->nmembers; mm++)
+    {
+      double tot_u = 0.0;
+
+      for (int ii = 0; ii < ny; ii++) tot_u += row_u[(size_t)ii * width + mm];
+
+      av_vels[mm] = (float)(tot_u / ens->tot_cells);
+    }
+  }
+}
+
+int d2q9_ensemble_get_fields(const d2q9_ensemble* ens, int member,
+                             float* u_x_out, float* u_y_out, float* u_out, float* pressure_out)
+{
+  const t_param params = ens->params;
+  const int width = ens->width;
+  const float c_sq = 1.0f / 3.0f; /* sq. of speed of sound */
+
+  if (member < 0 || member >= ens->nmembers)
+  {
+    d2q9_error("ensemble member out of range", __LINE__, __FILE__);
+    return EXIT_FAILURE;
+  }
+
+#pragma omp parallel for
+  for (int ii = 0; ii < params.ny; ii++)
+  {
+    for (int jj = 0; jj < params.nx; jj++)
+    {
+      const float* c = ens->cells + (size_t)(ii * ens->pitch + jj) * NSPEEDS * width + member;
+      float local_density = 0.0f;
+      float pressure, u_x, u_y, u;
+
+      if (ens->obstacles[ii * ens->pitch + jj])
+      {
+        u_x = u_y = u = 0.0f;
+        pressure = params.density * c_sq;
+      }
+      else
+      {
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          local_density += c[kk * width];
+        }
+
+        /* compute x velocity component */
+        u_x = (c[1 * width] + c[5 * width] + c[8 * width]
+               - (c[3 * width] + c[6 * width] + c[7 * width]))
+              / local_density;
+        /* compute y velocity component */
+        u_y = (c[2 * width] + c[5 * width] + c[6 * width]
+               - (c[4 * width] + c[7 * width] + c[8 * width]))
+              / local_density;
+        /* compute norm of velocity */
+        u = fast_sqrt((float)((u_x * u_x) + (u_y * u_y)));
+        /* compute pressure */
+        pressure = local_density * c_sq;
+      }
+
+      if (u_x_out != NULL) u_x_out[ii * params.nx + jj] = u_x;
+      if (u_y_out != NULL) u_y_out[ii * params.nx + jj] = u_y;
+      if (u_out != NULL) u_out[ii * params.nx + jj] = u;
+      if (pressure_out != NULL) pressure_out[ii * params.nx + jj] = pressure;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+float d2q9_ensemble_reynolds(const d2q9_ensemble* ens, int member)
+{
+  const int width = ens->width;
+  const float viscosity = 1.0f / 6.0f * (2.0f / ens->omega[member] - 1.0f);
+  double tot_u = 0.0;
+
+  /* each row is summed in float and the rows in double, in order, as
+  ** av_velocity() does, so that a member matches a separate run */
+  for (int ii = 0; ii < ens->params.ny; ii++)
+  {
+    float row_u = 0.0f;
+
+    for (int jj = 0; jj < ens->params.nx; jj++)
+    {
+      const float* c = ens->cells + (size_t)(ii * ens->pitch + jj) * NSPEEDS * width + member;
+      float local_density = 0.0f;
+
+      if (ens->obstacles[ii * ens->pitch + jj]) continue;
+
+      for (int kk = 0; kk < NSPEEDS; kk++) local_density += c[kk * width];
+
+      const float u_x = (c[1 * width] + c[5 * width] + c[8 * width]
+                         - (c[3 * width] + c[6 * width] + c[7 * width])) / local_density;
+      const float u_y = (c[2 * width] + c[5 * width] + c[6 * width]
+                         - (c[4 * width] + c[7 * width] + c[8 * width])) / local_density;
+
+      row_u += fast_sqrt(u_x * u_x + u_y * u_y);
+    }
+
+    tot_u += row_u;
+  }
+
+  return (float)(tot_u / ens->tot_cells) * ens->params.reynolds_dim / viscosity;
+}
+
+long d2q9_ensemble_page_size(const d2q9_ensemble* ens)
+{
+  return arena_page_size(&ens->arena);
+}
+
+void d2q9_ensemble_destroy(d2q9_ensemble* ens)
+{
+  if (ens == NULL) return;
+
+  arena_destroy(&ens->arena);
+  free(ens);
+}
@@ -0,0 +1,357 @@
+/*
+** Obstacle and parameter file generator for d2q9-bgk benchmarks.
+**
+** Writes <prefix>.dat, in the format of the shipped obstacles_*.dat, and a
+** matching <prefix>.params for any grid size, so that scaling runs are not
+** limited to the three shipped inputs:
+**
+**   box      walls on all four sides, as the shipped obstacle files
+**   channel  walls along the top and bottom rows only
+**   circles  --count discs of --radius at random positions, with --walls
+**   porous   discs of --radius at random positions until the fraction of
+**            fluid cells is at most --porosity, with --walls
+**   tile     --source, an obstacle file of --source-size, repeated to
+**            fill the grid
+**
+** Discs wrap around the edges as the lattice does. Random positions come
+** from a splitmix64 generator seeded with --seed, so the same arguments
+** give the same files on every machine and at every size.
+**
+** Usage: d2q9-geometry <kind> <nx> <ny> <prefix> [--seed <n>] [--radius <r>]
+**                      [--count <n>] [--porosity <p>] [--walls box|channel|none]
+**                      [--source <file> --source-size <nx>x<ny>]
+**                      [--steps <n>] [--reynolds-dim <n>] [--density <d>]
+**                      [--accel <a>] [--omega <w>]
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+
+#define WRITE_BUFFER (1 << 20)  /* stdio buffer of the obstacle file */
+#define CELLS_PER_CIRCLE 4096   /* default --count is one disc per this many cells */
+
+enum { WALLS_NONE, WALLS_BOX, WALLS_CHANNEL };
+
+/* what to generate, from the command line */
+typedef struct
+{
+  const char* kind;
+  int         nx, ny;
+  const char* prefix;
+  uint64_t    seed;
+  int         radius;       /* of the discs, 0 for the default of the kind */
+  long        count;        /* discs, 0 for one per CELLS_PER_CIRCLE cells */
+  double      porosity;     /* target fraction of fluid cells */
+  int         walls;        /* WALLS_* */
+  const char* source;       /* obstacle file to tile */
+  int         source_nx, source_ny;
+  /* the rest of the parameter file, as in input_128x128.params */
+  int         steps;
+  int         reynolds_dim;
+  double      density;
+  double      accel;
+  double      omega;
+} t_geometry;
+
+/* the next number of the splitmix64 sequence */
+static uint64_t next_random(uint64_t* state);
+
+/* uniform in [0, n) */
+static int random_below(uint64_t* state, int n);
+
+/* block the cells of a disc, wrapping around the edges; returns how many
+** were not blocked before */
+static long add_disc(char* obstacles, int nx, int ny, int cx, int cy, int radius);
+static long add_walls(char* obstacles, int nx, int ny, int walls);
+static long tile_source(char* obstacles, const t_geometry* geometry);
+
+static int write_files(const char* obstacles, const t_geometry* geometry);
+static void die(const char* message);
+static void usage(const char* exe);
+
+int main(int argc, char* argv[])
+{
+  t_geometry geometry;
+  char*      obstacles;
+  long       solid = 0;    /* blocked cells */
+  long       ncells;
+
+  if (argc < 5) usage(argv[0]);
+
+  memset(&geometry, 0, sizeof(geometry));
+  geometry.kind = argv[1];
+  geometry.nx = atoi(argv[2]);
+  geometry.ny = atoi(argv[3]);
+  geometry.prefix = argv[4];
+  geometry.seed = 1;
+  geometry.porosity = 0.7;
+  geometry.walls = WALLS_BOX;
+  geometry.steps = 40000;
+  geometry.reynolds_dim = 10;
+  geometry.density = 0.1;
+  geometry.accel = 0.005;
+  geometry.omega = 1.85;
+
+  for (int aa = 5; aa < argc; aa++)
+  {
+    const char* value = aa + 1 < argc ? argv[aa + 1] : NULL;
+
+    if (value == NULL) usage(argv[0]);
+
+    if (!strcmp(argv[aa], "--seed")) geometry.seed = strtoull(value, NULL, 10);
+    else if (!strcmp(argv[aa], "--radius")) geometry.radius = atoi(value);
+    else if (!strcmp(argv[aa], "--count")) geometry.count = atol(value);
+    else if (!strcmp(argv[aa], "--porosity")) geometry.porosity = atof(value);
+    else if (!strcmp(argv[aa], "--walls"))
+    {
+      if (!strcmp(value, "box")) geometry.walls = WALLS_BOX;
+      else if (!strcmp(value, "channel")) geometry.walls = WALLS_CHANNEL;
+      else if (!strcmp(value, "none")) geometry.walls = WALLS_NONE;
+      else usage(argv[0]);
+    }
+    else if (!strcmp(argv[aa], "--source")) geometry.source = value;
+    else if (!strcmp(argv[aa], "--source-size"))
+    {
+      if (sscanf(value, "%dx%d", &geometry.source_nx, &geometry.source_ny) != 2) usage(argv[0]);
+    }
+    else if (!strcmp(argv[aa], "--steps")) geometry.steps = atoi(value);
+    else if (!strcmp(argv[aa], "--reynolds-dim")) geometry.reynolds_dim = atoi(value);
+    else if (!strcmp(argv[aa], "--density")) geometry.density = atof(value);
+    else if (!strcmp(argv[aa], "--accel")) geometry.accel = atof(value);
+    else if (!strcmp(argv[aa], "--omega")) geometry.omega = atof(value);
+    else usage(argv[0]);
+
+    aa++;
+  }
+
+  /* the accelerated row, ny - 2, has to exist inside the walls */
+  if (geometry.nx < 3 || geometry.ny < 4) die("the grid must be at least 3x4 cells");
+  if (geometry.steps < 1) die("--steps must be at least 1");
+
+  ncells = (long)geometry.nx * geometry.ny;
+  obstacles = calloc(ncells, 1);
+
+  if (obstacles == NULL) die("cannot allocate memory for the obstacles");
+
+  if (!strcmp(geometry.kind, "box") || !strcmp(geometry.kind, "channel"))
+  {
+    solid = add_walls(obstacles, geometry.nx, geometry.ny, !strcmp(geometry.kind, "box") ? WALLS_BOX : WALLS_CHANNEL);
+  }
+  else if (!strcmp(geometry.kind, "circles"))
+  {
+    uint64_t state = geometry.seed;
+    long     count = geometry.count > 0 ? geometry.count : (ncells + CELLS_PER_CIRCLE - 1) / CELLS_PER_CIRCLE;
+    int      radius = geometry.radius > 0 ? geometry.radius : 8;
+
+    solid = add_walls(obstacles, geometry.nx, geometry.ny, geometry.walls);
+
+    for (long cc = 0; cc < count; cc++)
+    {
+      const int cx = random_below(&state, geometry.nx);
+      const int cy = random_below(&state, geometry.ny);
+
+      solid += add_disc(obstacles, geometry.nx, geometry.ny, cx, cy, radius);
+    }
+  }
+  else if (!strcmp(geometry.kind, "porous"))
+  {
+    uint64_t state = geometry.seed;
+    int      radius = geometry.radius > 0 ? geometry.radius : 4;
+
+    if (!(geometry.porosity > 0.0 && geometry.porosity <= 1.0)) die("--porosity must be in (0, 1]");
+
+    solid = add_walls(obstacles, geometry.nx, geometry.ny, geometry.walls);
+
+    while ((double)(ncells - solid) / ncells > geometry.porosity)
+    {
+      const int cx = random_below(&state, geometry.nx);
+      const int cy = random_below(&state, geometry.ny);
+
+      solid += add_disc(obstacles, geometry.nx, geometry.ny, cx, cy, radius);
+    }
+  }
+  else if (!strcmp(geometry.kind, "tile"))
+  {
+    if (geometry.source == NULL || geometry.source_nx < 1 || geometry.source_ny < 1)
+      die("tile needs --source and --source-size");
+
+    solid = tile_source(obstacles, &geometry);
+  }
+  else
+  {
+    usage(argv[0]);
+  }
+
+  if (solid == ncells) die("every cell is blocked");
+
+  if (write_files(obstacles, &geometry) != EXIT_SUCCESS) die("could not write the output files");
+
+  printf("%s.dat:\t%dx%d %s, %ld blocked cells, porosity %.4f\n", geometry.prefix, geometry.nx, geometry.ny,
+         geometry.kind, solid, (double)(ncells - solid) / ncells);
+  printf("%s.params:\t%d steps\n", geometry.prefix, geometry.steps);
+
+  free(obstacles);
+
+  return EXIT_SUCCESS;
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+  return z ^ (z >> 31);
+}
+
+static int random_below(uint64_t* state, int n)
+{
+  /* the top 53 bits as a double in [0, 1), which is exact on every platform */
+  return (int)((next_random(state) >> 11) * (1.0 / 9007199254740992.0) * n);
+}
+
+static long add_disc(char* obstacles, int nx, int ny, int cx, int cy, int radius)
+{
+  long added = 0;
+
+  for (int dy = -radius; dy <= radius; dy++)
+  {
+    for (int dx = -radius; dx <= radius; dx++)
+    {
+      if (dx * dx + dy * dy > radius * radius) continue;
+
+      {
+        const int jj = ((cx + dx) % nx + nx) % nx;
+        const int ii = ((cy + dy) % ny + ny) % ny;
+
+        if (!obstacles[(long)ii * nx + jj])
+        {
+          obstacles[(long)ii * nx + jj] = 1;
+          added++;
+        }
+      }
+    }
+  }
+
+  return added;
+}
+
+static long add_walls(char* obstacles, int nx, int ny, int walls)
+{
+  long added = 0;
+
+  if (walls == WALLS_NONE) return 0;
+
+  for (int ii = 0; ii < ny; ii++)
+  {
+    for (int jj = 0; jj < nx; jj++)
+    {
+      const int wall = ii == 0 || ii == ny - 1 || (walls == WALLS_BOX && (jj == 0 || jj == nx - 1));
+
+      if (wall && !obstacles[(long)ii * nx + jj])
+      {
+        obstacles[(long)ii * nx + jj] = 1;
+        added++;
+      }
+    }
+  }
+
+  return added;
+}
+
+static long tile_source(char* obstacles, const t_geometry* geometry)
+{
+  const int snx = geometry->source_nx;
+  const int sny = geometry->source_ny;
+  char*     source = calloc((long)snx * sny, 1);
+  FILE*     fp = fopen(geometry->source, "r");
+  int       xx, yy, blocked, retval;
+  long      solid = 0;
+
+  if (source == NULL) die("cannot allocate memory for the source obstacles");
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "could not open source obstacle file: %s\n", geometry->source);
+    exit(EXIT_FAILURE);
+  }
+
+  /* as d2q9_read_obstacles() */
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    if (retval != 3 || xx < 0 || xx >= snx || yy < 0 || yy >= sny || blocked != 1)
+      die("source obstacle file does not match --source-size");
+
+    source[(long)yy * snx + xx] = 1;
+  }
+
+  fclose(fp);
+
+  for (int ii = 0; ii < geometry->ny; ii++)
+  {
+    for (int jj = 0; jj < geometry->nx; jj++)
+    {
+      obstacles[(long)ii * geometry->nx + jj] = source[(long)(ii % sny) * snx + jj % snx];
+      solid += obstacles[(long)ii * geometry->nx + jj];
+    }
+  }
+
+  free(source);
+
+  return solid;
+}
+
+static int write_files(const char* obstacles, const t_geometry* geometry)
+{
+  char  filename[1024];
+  FILE* fp;
+  int   ok;
+
+  snprintf(filename, sizeof(filename), "%s.params", geometry->prefix);
+  fp = fopen(filename, "w");
+
+  if (fp == NULL) return EXIT_FAILURE;
+
+  fprintf(fp, "%d\n%d\n%d\n%d\n%g\n%g\n%g\n", geometry->nx, geometry->ny, geometry->steps, geometry->reynolds_dim,
+          geometry->density, geometry->accel, geometry->omega);
+
+  if (fclose(fp) != 0) return EXIT_FAILURE;
+
+  snprintf(filename, sizeof(filename), "%s.dat", geometry->prefix);
+  fp = fopen(filename, "w");
+
+  if (fp == NULL) return EXIT_FAILURE;
+
+  setvbuf(fp, NULL, _IOFBF, WRITE_BUFFER);
+
+  /* 'x y 1' per blocked cell, row by row */
+  for (int ii = 0; ii < geometry->ny; ii++)
+  {
+    for (int jj = 0; jj < geometry->nx; jj++)
+    {
+      if (obstacles[(long)ii * geometry->nx + jj]) fprintf(fp, "%d %d 1\n", jj, ii);
+    }
+  }
+
+  ok = !ferror(fp);
+
+  return fclose(fp) == 0 && ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void die(const char* message)
+{
+  fprintf(stderr, "d2q9-geometry: %s\n", message);
+  exit(EXIT_FAILURE);
+}
+
+static void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s box|channel|circles|porous|tile <nx> <ny> <prefix>\n"
+                  "       [--seed <n>] [--radius <r>] [--count <n>] [--porosity <p>]\n"
+                  "       [--walls box|channel|none] [--source <file> --source-size <nx>x<ny>]\n"
+                  "       [--steps <n>] [--reynolds-dim <n>] [--density <d>] [--accel <a>] [--omega <w>]\n", exe);
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,128 @@
+/*
+** Optional instrumentation of the timestep() kernels.
+**
+** Two independent backends share the same hooks:
+**
+** - hardware performance counters (perf_counters.c): each OpenMP thread
+**   opens its own group of counters with perf_event_open(2) (cycles,
+**   instructions, last level cache references/misses and LLC load/store
+**   misses, which are used to estimate memory traffic).
+**
+** - phase timing (trace.c): each thread reads the TSC at the start and
+**   end of its share of a kernel and of the barrier that follows it.
+**   Durations are accumulated for a summary table, and for sampled
+**   iterations the begin/end pairs are also stored in a preallocated
+**   per-thread ring buffer which can be exported as Chrome trace JSON
+**   (chrome://tracing or https://ui.perfetto.dev).
+**
+** Every thread of a kernel's parallel region brackets its work with
+** phase_begin()/phase_end() and then calls phase_barrier(). When neither
+** backend is enabled the hooks reduce to a test of a global flag, and
+** phase_barrier() adds no barrier.
+*/
+
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdio.h>
+
+/* the parts of a timestep which are measured separately */
+typedef enum
+{
+  PHASE_ACCELERATE,
+  PHASE_PROPAGATE,
+  PHASE_COLLISION,
+  PHASE_AV_VELOCITY,
+  PHASE_STREAM_COLLIDE, /* fused propagate, rebound and collision */
+  PHASE_BARRIER,        /* waiting for the other threads at the end of a kernel */
+  NPHASES
+} t_phase;
+
+extern const char* const phase_names[NPHASES];
+
+/*
+** hardware performance counters
+*/
+
+/* non-zero once perf_counters_init() has opened counters */
+extern int perf_counters_enabled;
+
+/* open the counters on every thread of the default OpenMP team,
+** returns the number of threads with working counters (0 on failure) */
+int perf_counters_init(void);
+
+/* print the per-kernel and per-thread totals */
+void perf_counters_report(FILE* fp);
+
+/* close all counters and free the per-thread state */
+void perf_counters_finalise(void);
+
+void perf_counters_read_begin(t_phase phase);
+void perf_counters_read_end(t_phase phase);
+
+/*
+** TSC phase timing and Chrome trace export
+*/
+
+/* non-zero once trace_init() has allocated the per-thread buffers */
+extern int trace_enabled;
+
+/* non-zero while the current iteration is one of the sampled ones */
+extern int trace_sampled;
+
+/* allocate a ring buffer of ring_events events for each thread of the
+** default OpenMP team, and record every sample_every'th iteration;
+** returns EXIT_SUCCESS or EXIT_FAILURE */
+int trace_init(int ring_events, int sample_every);
+
+/* called by main() at the start of each iteration */
+void trace_iteration(int tt);
+
+/* print per-phase and per-thread totals */
+void trace_report(FILE* fp, int iterations);
+
+/* write the sampled events as Chrome trace JSON */
+int trace_write_chrome(const char* filename);
+
+void trace_finalise(void);
+
+void trace_record_begin(t_phase phase);
+void trace_record_end(t_phase phase);
+
+/*
+** hooks called by every thread of a kernel's parallel region
+*/
+
+static inline void phase_begin(t_phase phase)
+{
+  if (perf_counters_enabled) perf_counters_read_begin(phase);
+  if (trace_enabled) trace_record_begin(phase);
+}
+
+static inline void phase_end(t_phase phase)
+{
+  if (trace_enabled) trace_record_end(phase);
+  if (perf_counters_enabled) perf_counters_read_end(phase);
+}
+
+/* make the load imbalance at the end of a kernel visible as its own phase;
+** the flags are the same on every thread so either all or none reach the barrier */
+static inline void phase_barrier(void)
+{
+  if (perf_counters_enabled || trace_enabled)
+  {
+    phase_begin(PHASE_BARRIER);
+#pragma omp barrier
+    phase_end(PHASE_BARRIER);
+  }
+}
+
+/* a barrier the algorithm needs in any case, timed as PHASE_BARRIER */
+static inline void phase_sync(void)
+{
+  phase_begin(PHASE_BARRIER);
+#pragma omp barrier
+  phase_end(PHASE_BARRIER);
+}
+
+#endif
@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+"""Performance regression suite for d2q9-bgk.
+
+Runs shortened versions of the shipped inputs with each kernel variant and
+thread count, and compares the lattice updates per second (MLUPS) with the
+baseline recorded for this CPU model in perf/baseline.json. Every run also
+checks its average velocities against the full reference run in check/
+with --reference, so a fast but wrong build fails as well.
+
+A case fails if its best MLUPS over the repeats is lower than the baseline
+by more than the threshold: the larger of --tolerance and three times the
+noise, where the noise is the relative spread of the repeats, now or when
+the baseline was recorded. The noise term is capped at 25%, so a noisy
+baseline cannot hide a large slowdown. CPU models with no baseline are reported and
+skipped (exit status 77, which CTest shows as skipped).
+
+    perf/perf.py --exe ./d2q9-bgk                # check
+    perf/perf.py --exe ./d2q9-bgk --update       # record this CPU's baseline
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+SOURCE_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# the shipped inputs and the steps of their shortened runs
+INPUTS = [
+    ("128x128", 1000),
+    ("128x256", 500),
+    ("256x256", 250),
+]
+
+# kernel variants, as d2q9-bgk options; --no-tune keeps the tuning database out
+VARIANTS = [
+    ("default", ["--nt-stores", "off"]),
+    ("nt-stores", ["--nt-stores", "on"]),
+    ("prefetch", ["--nt-stores", "off", "--prefetch", "16"]),
+]
+
+# the most the noise can raise the threshold to
+MAX_NOISE_THRESHOLD = 0.25
+
+SKIPPED = 77
+
+
+def cpu_model():
+    """The model name of the first cpu in /proc/cpuinfo, as autotune.c."""
+    try:
+        with open("/proc/cpuinfo") as cpuinfo:
+            for line in cpuinfo:
+                if line.startswith("model name") and ":" in line:
+                    return line.split(":", 1)[1].strip()
+    except OSError:
+        pass
+    return "unknown"
+
+
+def thread_counts():
+    """1 and the number of cores available, as batch.c counts them."""
+    try:
+        cores = len(os.sched_getaffinity(0))
+    except AttributeError:
+        cores = os.cpu_count() or 1
+    return sorted({1, cores})
+
+
+def shortened_params(size, steps, workdir):
+    """A copy of input_<size>.params with maxIters replaced by steps."""
+    with open(os.path.join(SOURCE_DIR, "input_%s.params" % size)) as params:
+        lines = params.read().split("\n")
+    lines[2] = str(steps)
+    path = os.path.join(workdir, "input_%s.params" % size)
+    with open(path, "w") as params:
+        params.write("\n".join(lines))
+    return path
+
+
+def run_case(args, size, steps, options, threads, workdir):
+    """MLUPS of each repeat, or raises RuntimeError if a run fails."""
+    nx, ny = (int(n) for n in size.split("x"))
+    params = shortened_params(size, steps, workdir)
+    command = [args.exe, params, os.path.join(SOURCE_DIR, "obstacles_%s.dat" % size), "--no-tune",
+               "--reference", os.path.join(SOURCE_DIR, "check", "%s.av_vels.dat" % size),
+               "--reference-tolerance", str(args.check_tolerance)] + options
+    env = dict(os.environ, OMP_NUM_THREADS=str(threads))
+    mlups = []
+
+    for _ in range(args.repeats):
+        run = subprocess.run(command, cwd=workdir, env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                             universal_newlines=True)
+        if run.returncode != 0:
+            raise RuntimeError("%s failed with status %d:\n%s" % (" ".join(command), run.returncode, run.stdout))
+
+        elapsed = re.search(r"^Elapsed time:\s+([0-9.eE+-]+)", run.stdout, re.MULTILINE)
+        if elapsed is None:
+            raise RuntimeError("no elapsed time in the output of %s" % " ".join(command))
+
+        mlups.append(nx * ny * steps / max(float(elapsed.group(1)), 1e-9) / 1e6)
+
+    return mlups
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--exe", required=True, help="the d2q9-bgk executable")
+    parser.add_argument("--baseline", default=os.path.join(SOURCE_DIR, "perf", "baseline.json"),
+                        help="the baseline file (default: %(default)s)")
+    parser.add_argument("--inputs", nargs="+", choices=[size for size, _ in INPUTS],
+                        default=[size for size, _ in INPUTS], help="the inputs to run (default: all)")
+    parser.add_argument("--repeats", type=int, default=3, help="runs of each case, the best counts (default: 3)")
+    parser.add_argument("--tolerance", type=float, default=0.10,
+                        help="smallest relative slowdown which fails (default: %(default)s)")
+    parser.add_argument("--check-tolerance", type=float, default=1.0,
+                        help="percentage tolerance of the reference check (default: %(default)s)")
+    parser.add_argument("--update", action="store_true",
+                        help="record the results as the baseline for this CPU instead of checking them")
+    args = parser.parse_args()
+    args.exe = os.path.abspath(args.exe)
+
+    model = cpu_model()
+    try:
+        with open(args.baseline) as baseline_file:
+            baseline = json.load(baseline_file)
+    except FileNotFoundError:
+        baseline = {"cpus": {}}
+    recorded = baseline["cpus"].get(model, {})
+
+    print("CPU: %s" % model)
+    print("%-32s %10s %10s %8s %10s" % ("case", "MLUPS", "baseline", "noise", "change"))
+
+    workdir = tempfile.mkdtemp(prefix="d2q9-perf-")
+    results = {}
+    failures = []
+    try:
+        for size, steps in INPUTS:
+            if size not in args.inputs:
+                continue
+            for variant, options in VARIANTS:
+                for threads in thread_counts():
+                    case = "%s/%s/%d" % (size, variant, threads)
+                    try:
+                        mlups = run_case(args, size, steps, options, threads, workdir)
+                    except RuntimeError as error:
+                        print("%-32s FAILED" % case)
+                        failures.append("%s: %s" % (case, error))
+                        continue
+
+                    best = max(mlups)
+                    noise = (best - min(mlups)) / best
+                    results[case] = {"mlups": round(best, 3), "noise": round(noise, 4)}
+
+                    if case not in recorded:
+                        print("%-32s %10.2f %10s %7.1f%%" % (case, best, "-", 100 * noise))
+                        continue
+
+                    base = recorded[case]
+                    change = best / base["mlups"] - 1
+                    threshold = max(args.tolerance, min(3 * max(noise, base["noise"]), MAX_NOISE_THRESHOLD))
+                    verdict = ""
+                    if change < -threshold and not args.update:
+                        verdict = "  slower than -%.0f%%" % (100 * threshold)
+                        failures.append("%s: %.2f MLUPS, %.1f%% below the baseline %.2f" %
+                                        (case, best, -100 * change, base["mlups"]))
+                    print("%-32s %10.2f %10.2f %7.1f%% %+9.1f%%%s" %
+                          (case, best, base["mlups"], 100 * noise, 100 * change, verdict))
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    if args.update and not failures:
+        recorded.update(results)
+        baseline["cpus"][model] = dict(sorted(recorded.items()))
+        with open(args.baseline, "w") as baseline_file:
+            json.dump(baseline, baseline_file, indent=2, sort_keys=True)
+            baseline_file.write("\n")
+        print("Recorded the baseline for %s in %s" % (model, args.baseline))
+        return 0
+
+    for failure in failures:
+        print(failure)
+
+    if failures:
+        return 1
+
+    if not recorded:
+        print("No baseline for this CPU; record one with --update")
+        return SKIPPED
+
+    print("All cases within their thresholds")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
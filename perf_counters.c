@@ -0,0 +1,348 @@
+/*
+** Hardware performance counters for the timestep() kernels,
+** see instrument.h.
+*/
+
+#define _GNU_SOURCE
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<stdint.h>
+#include <omp.h>
+
+#include "instrument.h"
+
+#ifdef __linux__
+#include<unistd.h>
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define CACHE_LINE       64
+#define PERF_NEVENTS     6
+
+/* indices into the event table, used when deriving metrics */
+#define EV_CYCLES        0
+#define EV_INSTRUCTIONS  1
+#define EV_LLC_REFS      2
+#define EV_LLC_MISSES    3
+#define EV_LLC_LOAD_MISS 4
+#define EV_LLC_STORE_MISS 5
+
+const char* const phase_names[NPHASES] = {
+  "accelerate_flow",
+  "propagate",
+  "rebound_and_collision",
+  "av_velocity",
+  "stream_collide",
+  "barrier"
+};
+
+int perf_counters_enabled = 0;
+
+/* per-thread counter state, padded so that threads do not share lines */
+typedef struct
+{
+  int      leader;                           /* group leader fd, -1 if unavailable */
+  int      nopen;                            /* number of events in the group */
+  int      fd[PERF_NEVENTS];                 /* fd of each event, -1 if it could not be opened */
+  int      slot[PERF_NEVENTS];               /* position of each event in the group read, or -1 */
+  uint64_t start[PERF_NEVENTS + 3];          /* group read at phase_begin() */
+  uint64_t counts[NPHASES][PERF_NEVENTS];    /* accumulated counts */
+  uint64_t enabled_ns[NPHASES];              /* accumulated time the group was enabled */
+  uint64_t running_ns[NPHASES];              /* accumulated time the group was counting */
+  uint64_t calls[NPHASES];
+} t_perf_thread;
+
+typedef struct
+{
+  t_perf_thread t;
+  char pad[CACHE_LINE - sizeof(t_perf_thread) % CACHE_LINE];
+} t_perf_thread_padded;
+
+static t_perf_thread_padded* perf_threads = NULL;
+static int perf_nthreads = 0;
+
+#ifdef __linux__
+
+static const struct
+{
+  const char* name;
+  uint32_t    type;
+  uint64_t    config;
+} perf_events[PERF_NEVENTS] = {
+  { "cycles",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "llc-refs",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+  { "llc-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "llc-load-miss",  PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+                                          | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  { "llc-store-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+                                          | (PERF_COUNT_HW_CACHE_OP_WRITE << 8)
+                                          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) }
+};
+
+static int perf_event_open(struct perf_event_attr* attr, int group_fd)
+{
+  /* measure the calling thread on whichever cpu it runs */
+  return (int)syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+/* open the event group for the calling thread, returns errno on failure */
+static int open_thread_counters(t_perf_thread* pt)
+{
+  pt->leader = -1;
+  pt->nopen = 0;
+
+  for (int ee = 0; ee < PERF_NEVENTS; ee++) pt->fd[ee] = -1;
+
+  for (int ee = 0; ee < PERF_NEVENTS; ee++)
+  {
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[ee].type;
+    attr.config = perf_events[ee].config;
+    attr.read_format = PERF_FORMAT_GROUP
+                       | PERF_FORMAT_TOTAL_TIME_ENABLED
+                       | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = (pt->leader == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = perf_event_open(&attr, pt->leader);
+    pt->fd[ee] = fd;
+    pt->slot[ee] = -1;
+
+    if (fd == -1)
+    {
+      /* the group is useless without cycles, but other events are optional */
+      if (ee == EV_CYCLES) return errno;
+      continue;
+    }
+
+    if (pt->leader == -1) pt->leader = fd;
+    pt->slot[ee] = pt->nopen++;
+  }
+
+  ioctl(pt->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(pt->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+  return 0;
+}
+
+int perf_counters_init(void)
+{
+  int nworking = 0;
+  int first_err = 0;
+
+  perf_nthreads = omp_get_max_threads();
+
+  /* aligned, so that the padding keeps each thread on its own cache lines */
+  if (posix_memalign((void**)&perf_threads, CACHE_LINE, perf_nthreads * sizeof(t_perf_thread_padded)))
+  {
+    perf_threads = NULL;
+    fprintf(stderr, "perf counters: cannot allocate per-thread state\n");
+    return 0;
+  }
+
+  memset(perf_threads, 0, perf_nthreads * sizeof(t_perf_thread_padded));
+
+#pragma omp parallel reduction(+:nworking)
+  {
+    t_perf_thread* pt = &perf_threads[omp_get_thread_num()].t;
+    int err = open_thread_counters(pt);
+
+    if (err)
+    {
+#pragma omp critical
+      if (!first_err) first_err = err;
+    }
+    else
+    {
+      nworking++;
+    }
+  }
+
+  if (nworking == 0)
+  {
+    fprintf(stderr, "perf counters unavailable: perf_event_open: %s\n", strerror(first_err));
+    perf_counters_finalise();
+    return 0;
+  }
+
+  if (nworking < perf_nthreads)
+  {
+    fprintf(stderr, "perf counters: only %d of %d threads have counters\n", nworking, perf_nthreads);
+  }
+
+  perf_counters_enabled = 1;
+
+  return nworking;
+}
+
+void perf_counters_read_begin(t_phase phase)
+{
+  int tid = omp_get_thread_num();
+
+  if (tid >= perf_nthreads || perf_threads[tid].t.leader == -1) return;
+
+  t_perf_thread* pt = &perf_threads[tid].t;
+
+  if (read(pt->leader, pt->start, sizeof(uint64_t) * (3 + pt->nopen)) <= 0)
+  {
+    pt->start[0] = 0;
+  }
+}
+
+void perf_counters_read_end(t_phase phase)
+{
+  int tid = omp_get_thread_num();
+
+  if (tid >= perf_nthreads || perf_threads[tid].t.leader == -1) return;
+
+  t_perf_thread* pt = &perf_threads[tid].t;
+  uint64_t now[PERF_NEVENTS + 3];
+
+  /* layout: nr, time_enabled, time_running, values[nr] */
+  if (pt->start[0] == 0 || read(pt->leader, now, sizeof(uint64_t) * (3 + pt->nopen)) <= 0) return;
+
+  pt->enabled_ns[phase] += now[1] - pt->start[1];
+  pt->running_ns[phase] += now[2] - pt->start[2];
+  pt->calls[phase]++;
+
+  for (int ee = 0; ee < PERF_NEVENTS; ee++)
+  {
+    if (pt->slot[ee] >= 0)
+    {
+      pt->counts[phase][ee] += now[3 + pt->slot[ee]] - pt->start[3 + pt->slot[ee]];
+    }
+  }
+}
+
+void perf_counters_finalise(void)
+{
+  if (perf_threads != NULL)
+  {
+    for (int tt = 0; tt < perf_nthreads; tt++)
+    {
+      for (int ee = 0; ee < PERF_NEVENTS; ee++)
+      {
+        if (perf_threads[tt].t.fd[ee] != -1) close(perf_threads[tt].t.fd[ee]);
+      }
+    }
+  }
+
+  free(perf_threads);
+  perf_threads = NULL;
+  perf_nthreads = 0;
+  perf_counters_enabled = 0;
+}
+
+#else /* !__linux__ */
+
+int perf_counters_init(void)
+{
+  fprintf(stderr, "perf counters unavailable: perf_event_open requires Linux\n");
+  return 0;
+}
+
+void perf_counters_read_begin(t_phase phase) { (void)phase; }
+void perf_counters_read_end(t_phase phase) { (void)phase; }
+void perf_counters_finalise(void) {}
+
+#endif
+
+/* scale a count for the time the group was multiplexed off the PMU */
+static double scaled(const t_perf_thread* pt, int phase, int ev)
+{
+  if (pt->slot[ev] < 0) return -1.0;
+  if (pt->running_ns[phase] == 0) return 0.0;
+
+  return (double)pt->counts[phase][ev] * (double)pt->enabled_ns[phase] / (double)pt->running_ns[phase];
+}
+
+static void print_row(FILE* fp, const char* phase, const char* thread,
+                      const double ev[PERF_NEVENTS], double seconds)
+{
+  double traffic;
+
+  fprintf(fp, "%-22s %6s %14.0f %14.0f %6.2f", phase, thread,
+          ev[EV_CYCLES], ev[EV_INSTRUCTIONS],
+          ev[EV_CYCLES] > 0.0 ? ev[EV_INSTRUCTIONS] / ev[EV_CYCLES] : 0.0);
+
+  if (ev[EV_LLC_REFS] >= 0.0) fprintf(fp, " %12.0f", ev[EV_LLC_REFS]);
+  else                        fprintf(fp, " %12s", "n/a");
+
+  if (ev[EV_LLC_MISSES] >= 0.0) fprintf(fp, " %12.0f", ev[EV_LLC_MISSES]);
+  else                          fprintf(fp, " %12s", "n/a");
+
+  /* every LLC miss moves one line to or from memory */
+  if (ev[EV_LLC_LOAD_MISS] >= 0.0 && ev[EV_LLC_STORE_MISS] >= 0.0 && seconds > 0.0)
+  {
+    traffic = (ev[EV_LLC_LOAD_MISS] + ev[EV_LLC_STORE_MISS]) * CACHE_LINE;
+    fprintf(fp, " %10.3f\n", traffic / seconds / 1.0e9);
+  }
+  else
+  {
+    fprintf(fp, " %10s\n", "n/a");
+  }
+}
+
+void perf_counters_report(FILE* fp)
+{
+  if (!perf_counters_enabled) return;
+
+  fprintf(fp, "==perf counters==\n");
+  fprintf(fp, "%-22s %6s %14s %14s %6s %12s %12s %10s\n", "kernel", "thread",
+          "cycles", "instructions", "IPC", "LLC refs", "LLC misses", "mem GB/s");
+
+  for (int pp = 0; pp < NPHASES; pp++)
+  {
+    double total[PERF_NEVENTS];
+    double max_seconds = 0.0;
+    int ran = 0;
+
+    /* phases that no thread recorded, such as accelerate outside an
+    ** ensemble, get no rows at all */
+    for (int tt = 0; tt < perf_nthreads; tt++)
+    {
+      if (perf_threads[tt].t.leader != -1 && perf_threads[tt].t.calls[pp] > 0) ran = 1;
+    }
+
+    if (!ran) continue;
+
+    for (int ee = 0; ee < PERF_NEVENTS; ee++) total[ee] = 0.0;
+
+    for (int tt = 0; tt < perf_nthreads; tt++)
+    {
+      const t_perf_thread* pt = &perf_threads[tt].t;
+      double ev[PERF_NEVENTS];
+      double seconds = pt->enabled_ns[pp] * 1.0e-9;
+      char label[16];
+
+      if (pt->leader == -1 || pt->calls[pp] == 0) continue;
+
+      for (int ee = 0; ee < PERF_NEVENTS; ee++)
+      {
+        ev[ee] = scaled(pt, pp, ee);
+        /* an event missing on one thread is missing from the total */
+        total[ee] = (ev[ee] < 0.0 || total[ee] < 0.0) ? -1.0 : total[ee] + ev[ee];
+      }
+
+      if (seconds > max_seconds) max_seconds = seconds;
+
+      sprintf(label, "%d", tt);
+      print_row(fp, phase_names[pp], label, ev, seconds);
+    }
+
+    /* threads run concurrently, so the slowest one bounds the kernel time */
+    print_row(fp, phase_names[pp], "all", total, max_seconds);
+  }
+}
@@ -0,0 +1,229 @@
+/*
+** In-process validation of d2q9-bgk against reference results
+** (--reference <av_vels.dat> [--reference-final <final_state.dat>]).
+**
+** The reference files are read before the run. The average velocity of
+** each step is compared as soon as it is computed, and the pressure of
+** every cell at the end, with the same test as d2q9-check: the difference
+** diff = ref - sim, as a percentage 100 * diff / sim, has to be finite and
+** within the tolerance. The run stops at the first step outside it, rather
+** than after maxIters steps and a separate make check. Without a final
+** state, the reference may be a longer run, such as the full runs in
+** check/, which is compared on its first maxIters steps.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<math.h>
+
+#include "d2q9-bgk.h"
+
+#define REFERENCE_LINE 1024
+
+/* diff and its percentage of sim; non-zero if within tolerance */
+static int within(double ref, double sim, double tolerance, double* diff, double* pcnt);
+
+/* by the exponent bits, which holds under -Ofast */
+static int is_finite(double x);
+
+/* track the largest percentage difference in stats */
+static void add_diff(t_ref_stats* stats, long index, double ref, double sim, double diff, double pcnt);
+
+int reference_read(t_reference* reference, const char* av_vels_file, const char* final_state_file,
+                   const t_param params)
+{
+  char  line[REFERENCE_LINE];
+  FILE* fp;
+
+  memset(reference, 0, sizeof(t_reference));
+  reference->tolerance = REFERENCE_TOLERANCE;
+
+  /* the average velocities, 'step:\tvalue' */
+  fp = fopen(av_vels_file, "r");
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "could not open reference file: %s\n", av_vels_file);
+    return EXIT_FAILURE;
+  }
+
+  reference->av_vels = malloc(sizeof(double) * params.maxIters);
+
+  if (reference->av_vels == NULL) die("cannot allocate memory for reference av_vels", __LINE__, __FILE__);
+
+  while (reference->nsteps < params.maxIters && fgets(line, sizeof(line), fp) != NULL)
+  {
+    int step;
+
+    if (sscanf(line, "%d: %lf", &step, &reference->av_vels[reference->nsteps]) != 2)
+    {
+      fprintf(stderr, "could not read line %d of reference file: %s\n", reference->nsteps + 1, av_vels_file);
+      fclose(fp);
+      return EXIT_FAILURE;
+    }
+
+    reference->nsteps++;
+  }
+
+  /* a longer run starts the same, but only ends the same if it is as long */
+  if (reference->nsteps < params.maxIters
+      || (final_state_file != NULL && fgets(line, sizeof(line), fp) != NULL))
+  {
+    fprintf(stderr, "reference file has a different number of steps: %s\n", av_vels_file);
+    fclose(fp);
+    return EXIT_FAILURE;
+  }
+
+  fclose(fp);
+
+  if (final_state_file == NULL) return EXIT_SUCCESS;
+
+  /* the final state, 'jj ii u_x u_y u pressure obstacle', compared on pressure */
+  fp = fopen(final_state_file, "r");
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "could not open reference file: %s\n", final_state_file);
+    return EXIT_FAILURE;
+  }
+
+  reference->coords = malloc(sizeof(int) * 2 * params.nx * params.ny);
+  reference->pressure = malloc(sizeof(double) * params.nx * params.ny);
+
+  if (reference->coords == NULL || reference->pressure == NULL)
+    die("cannot allocate memory for reference final state", __LINE__, __FILE__);
+
+  while (fgets(line, sizeof(line), fp) != NULL && reference->ncells <= params.nx * params.ny)
+  {
+    const int cc = reference->ncells;
+    double    skip;
+
+    if (cc == params.nx * params.ny
+        || sscanf(line, "%d %d %lf %lf %lf %lf", &reference->coords[2 * cc], &reference->coords[2 * cc + 1],
+                  &skip, &skip, &skip, &reference->pressure[cc]) != 6
+        || reference->coords[2 * cc] < 0 || reference->coords[2 * cc] >= params.nx
+        || reference->coords[2 * cc + 1] < 0 || reference->coords[2 * cc + 1] >= params.ny)
+    {
+      fprintf(stderr, "reference final state does not match the grid: %s\n", final_state_file);
+      fclose(fp);
+      return EXIT_FAILURE;
+    }
+
+    reference->ncells++;
+  }
+
+  fclose(fp);
+
+  if (reference->ncells != params.nx * params.ny)
+  {
+    fprintf(stderr, "reference final state does not match the grid: %s\n", final_state_file);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int reference_check_step(t_reference* reference, int tt, float av_vel)
+{
+  double diff, pcnt;
+  int    ok = within(reference->av_vels[tt], av_vel, reference->tolerance, &diff, &pcnt);
+
+  add_diff(&reference->av_vels_stats, tt, reference->av_vels[tt], av_vel, diff, pcnt);
+
+  if (!ok)
+  {
+    printf("av_vels failed check at step %d : %.12E\n", tt, diff);
+    printf("  %.12E vs. %.12E = %.2g%%\n", (double)av_vel, reference->av_vels[tt], pcnt);
+    fflush(stdout);
+  }
+
+  return ok;
+}
+
+int reference_check_final(t_reference* reference, const d2q9_sim* sim)
+{
+  const t_param params = *d2q9_params(sim);
+  const t_ref_stats* av = &reference->av_vels_stats;
+  const t_ref_stats* fs = &reference->final_state_stats;
+  float* pressure;
+  int    ok = 1;
+
+  printf("==reference==\n");
+  printf("Total difference in av_vels : %.12E\n", av->total);
+  printf("Biggest difference (at step %ld) : %.12E\n", av->max_index, av->max_diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n", av->sim_val, av->ref_val, av->max_pcnt);
+
+  if (reference->ncells == 0) return ok;
+
+  pressure = malloc(sizeof(float) * params.nx * params.ny);
+
+  if (pressure == NULL) die("cannot allocate memory for the final state", __LINE__, __FILE__);
+
+  d2q9_get_fields(sim, NULL, NULL, NULL, pressure);
+
+  /* in the order of the reference file */
+  for (int cc = 0; cc < reference->ncells; cc++)
+  {
+    const int jj = reference->coords[2 * cc];
+    const int ii = reference->coords[2 * cc + 1];
+    double    diff, pcnt;
+
+    ok &= within(reference->pressure[cc], pressure[ii * params.nx + jj], reference->tolerance, &diff, &pcnt);
+    add_diff(&reference->final_state_stats, cc, reference->pressure[cc], pressure[ii * params.nx + jj], diff, pcnt);
+  }
+
+  free(pressure);
+
+  printf("\n");
+  printf("Total difference in final_state : %.12E\n", fs->total);
+  printf("Biggest difference (at coord (%d,%d)) : %.12E\n", reference->coords[2 * fs->max_index],
+         reference->coords[2 * fs->max_index + 1], fs->max_diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n", fs->sim_val, fs->ref_val, fs->max_pcnt);
+
+  if (!ok) printf("final state failed check\n");
+
+  return ok;
+}
+
+void reference_free(t_reference* reference)
+{
+  free(reference->av_vels);
+  free(reference->coords);
+  free(reference->pressure);
+  memset(reference, 0, sizeof(t_reference));
+}
+
+static int within(double ref, double sim, double tolerance, double* diff, double* pcnt)
+{
+  *diff = ref - sim;
+  *pcnt = 100.0 * (*diff / (ref - *diff));
+
+  return is_finite(*pcnt) && fabs(*pcnt) <= tolerance;
+}
+
+static int is_finite(double x)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &x, sizeof(bits));
+
+  return (bits & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL;
+}
+
+static void add_diff(t_ref_stats* stats, long index, double ref, double sim, double diff, double pcnt)
+{
+  /* the first value which is not finite, or else the first largest */
+  if (index == 0
+      || (is_finite(stats->max_pcnt) && (!is_finite(pcnt) || fabs(pcnt) > fabs(stats->max_pcnt))))
+  {
+    stats->max_index = index;
+    stats->max_diff = diff;
+    stats->max_pcnt = pcnt;
+    stats->sim_val = sim;
+    stats->ref_val = ref;
+  }
+
+  stats->total += fabs(diff);
+}
@@ -0,0 +1,412 @@
+/*
+** Server mode of d2q9-bgk: a resident process which runs jobs sent to it
+** over a Unix domain socket.
+**
+**   d2q9-bgk --serve <socket>
+**   d2q9-bgk --request <socket> 'paramfile obstaclefile [prefix [outputs]]'
+**
+** A separate run of every point of a parameter sweep pays for process
+** startup, the allocation and page faulting of the lattice, and the
+** creation of the OpenMP thread pool before its first step. The server
+** pays for those once: it keeps the simulations of the last SERVER_SIMS
+** grid sizes, and a job of a size seen before is started over in the same
+** buffers with d2q9_reset(), on pages already placed by the threads which
+** update them and with the thread pool already running. The tuning
+** database is looked up when a simulation is created, as for a single run.
+**
+** Clients send one job per line, in the format of a batch job file (see
+** batch.c) with an optional last field, a comma separated list of the
+** outputs wanted: av_vels, final_state (the default is both) or none.
+** Relative paths are relative to the server's working directory. The
+** outputs are <prefix>av_vels.dat and <prefix>final_state.dat, the prefix
+** defaulting to none. Each job is answered with one line,
+**
+**   ok <iterations> <reynolds> <setup seconds> <run seconds>
+**
+** or 'error <message>'. The setup time covers reading the input files and
+** creating or resetting the simulation. The line 'quit' stops the server.
+** Jobs are run one at a time, each on all the kernel threads.
+*/
+
+#define _GNU_SOURCE
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<signal.h>
+#include<unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "d2q9-bgk.h"
+
+#define SERVER_SIMS    4        /* grid sizes kept */
+#define SERVER_BACKLOG 8        /* connections waiting to be accepted */
+#define SERVER_LINE    2048
+
+/* a simulation kept between jobs of its grid size */
+typedef struct
+{
+  d2q9_sim* sim;                /* NULL until a job of this size got that far */
+  int       nx, ny;
+  int*      obstacles;          /* of the current job */
+  float*    fields;             /* u_x, u_y, u and pressure for the final state */
+  long      last_used;          /* job number */
+} t_server_sim;
+
+/* the entry for nx x ny, evicting the least recently used if need be */
+static t_server_sim* find_sim(t_server_sim* sims, int nx, int ny);
+
+/* run the job of one request line, writing the reply to reply */
+static void run_request(t_server_sim* sims, long job, const char* line, char* reply, int size);
+
+static int open_socket(const char* socketpath, int listening);
+
+int run_server(const char* socketpath)
+{
+  t_server_sim sims[SERVER_SIMS];
+  char         line[SERVER_LINE];
+  char         reply[SERVER_LINE];
+  long         njobs = 0;
+  int          quit = 0;
+  int          listener = open_socket(socketpath, 1);
+
+  if (listener < 0) die("could not listen on the socket", __LINE__, __FILE__);
+
+  /* a client which goes away must not take the server with it */
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(sims, 0, sizeof(sims));
+
+  printf("==server==\n");
+  printf("Listening on:\t\t\t%s\n", socketpath);
+  fflush(stdout);
+
+  while (!quit)
+  {
+    FILE* in;
+    FILE* out;
+    int   fd = accept(listener, NULL, NULL);
+
+    if (fd < 0)
+    {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    in = fdopen(fd, "r");
+    out = fdopen(dup(fd), "w");
+
+    if (in == NULL || out == NULL) die("could not open the connection", __LINE__, __FILE__);
+
+    while (!quit && fgets(line, sizeof(line), in) != NULL)
+    {
+      line[strcspn(line, "\r\n")] = '\0';
+
+      if (line[0] == '\0' || line[0] == '#') continue;
+
+      if (!strcmp(line, "quit"))
+      {
+        snprintf(reply, sizeof(reply), "ok quit");
+        quit = 1;
+      }
+      else
+      {
+        run_request(sims, ++njobs, line, reply, sizeof(reply));
+        printf("Job %ld: %s: %s\n", njobs, line, reply);
+        fflush(stdout);
+      }
+
+      fprintf(out, "%s\n", reply);
+      fflush(out);
+    }
+
+    fclose(in);
+    fclose(out);
+  }
+
+  close(listener);
+  unlink(socketpath);
+
+  for (int ss = 0; ss < SERVER_SIMS; ss++)
+  {
+    if (sims[ss].sim != NULL) d2q9_destroy(sims[ss].sim);
+    free(sims[ss].obstacles);
+    free(sims[ss].fields);
+  }
+
+  printf("Jobs run:\t\t\t%ld\n", njobs);
+
+  return EXIT_SUCCESS;
+}
+
+int server_request(const char* socketpath, const char* request)
+{
+  char  line[SERVER_LINE];
+  int   ok = 1;
+  int   fd = open_socket(socketpath, 0);
+  FILE* in;
+
+  if (fd < 0) die("could not connect to the server", __LINE__, __FILE__);
+
+  /* '-' sends the lines of stdin instead */
+  if (!strcmp(request, "-"))
+  {
+    while (fgets(line, sizeof(line), stdin) != NULL)
+    {
+      if (write(fd, line, strlen(line)) < 0) die("could not send the request", __LINE__, __FILE__);
+    }
+  }
+  else if (write(fd, request, strlen(request)) < 0 || write(fd, "\n", 1) < 0)
+  {
+    die("could not send the request", __LINE__, __FILE__);
+  }
+
+  shutdown(fd, SHUT_WR);
+  in = fdopen(fd, "r");
+
+  if (in == NULL) die("could not read the reply", __LINE__, __FILE__);
+
+  while (fgets(line, sizeof(line), in) != NULL)
+  {
+    fputs(line, stdout);
+    if (strncmp(line, "ok", 2)) ok = 0;
+  }
+
+  fclose(in);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void run_request(t_server_sim* sims, long job, const char* line, char* reply, int size)
+{
+  char          paramfile[512], obstaclefile[512], filename[1024];
+  char          prefix[256] = "";
+  char          outputs[256] = "av_vels,final_state";
+  int           want_av_vels, want_final_state;
+  t_param       params;
+  t_server_sim* entry;
+  t_av_vels_writer* av_vels_out = NULL;
+  double        tic = wtime();
+  double        setup;
+
+  if (sscanf(line, "%511s %511s %255s %255s", paramfile, obstaclefile, prefix, outputs) < 2)
+  {
+    snprintf(reply, size, "error expected 'paramfile obstaclefile [prefix [outputs]]'");
+    return;
+  }
+
+  want_av_vels = strstr(outputs, "av_vels") != NULL;
+  want_final_state = strstr(outputs, "final_state") != NULL;
+
+  if (!want_av_vels && !want_final_state && strcmp(outputs, "none"))
+  {
+    snprintf(reply, size, "error unknown outputs: %s", outputs);
+    return;
+  }
+
+  if (d2q9_read_params(paramfile, &params) != EXIT_SUCCESS)
+  {
+    snprintf(reply, size, "error could not load parameters: %s", paramfile);
+    return;
+  }
+
+  if (params.nx < 1 || params.ny < 3 || params.maxIters < 0)
+  {
+    snprintf(reply, size, "error invalid parameters: %s", paramfile);
+    return;
+  }
+
+  entry = find_sim(sims, params.nx, params.ny);
+  entry->last_used = job;
+
+  if (d2q9_read_obstacles(obstaclefile, &params, entry->obstacles) != EXIT_SUCCESS)
+  {
+    snprintf(reply, size, "error could not load obstacles: %s", obstaclefile);
+    return;
+  }
+
+  if (entry->sim == NULL)
+  {
+    t_tuning     tuning;
+    d2q9_options options;
+    const int    tuned = tuning_lookup(tuning_db_path(), &params, &tuning);
+
+    d2q9_default_options(&options);
+
+    if (tuned)
+    {
+      options.streaming_stores = tuning.streaming_stores;
+      options.row_pitch = tuning.row_pitch;
+      options.tile = tuning.tile;
+    }
+
+    entry->sim = d2q9_create_with_options(&params, entry->obstacles, &options);
+
+    if (entry->sim == NULL)
+    {
+      snprintf(reply, size, "error could not create simulation");
+      return;
+    }
+
+    if (tuned)
+    {
+      d2q9_set_threads(entry->sim, tuning.nthreads);
+      d2q9_set_prefetch(entry->sim, tuning.prefetch);
+    }
+  }
+  else if (d2q9_reset(entry->sim, &params, entry->obstacles) != EXIT_SUCCESS)
+  {
+    snprintf(reply, size, "error could not reset simulation");
+    return;
+  }
+
+  /* opened up front, so that a bad prefix is an error rather than a die() */
+  if (want_final_state)
+  {
+    FILE* fp;
+
+    snprintf(filename, sizeof(filename), "%sfinal_state.dat", prefix);
+    fp = fopen(filename, "w");
+
+    if (fp == NULL)
+    {
+      snprintf(reply, size, "error could not open %s", filename);
+      return;
+    }
+
+    fclose(fp);
+  }
+
+  if (want_av_vels)
+  {
+    snprintf(filename, sizeof(filename), "%sav_vels.dat", prefix);
+    av_vels_out = av_vels_writer_open(filename);
+
+    if (av_vels_out == NULL)
+    {
+      snprintf(reply, size, "error could not open %s", filename);
+      return;
+    }
+  }
+
+  setup = wtime() - tic;
+  tic = wtime();
+
+  if (av_vels_out != NULL)
+  {
+    for (int tt = 0; tt < params.maxIters; tt++)
+    {
+      float av_vel;
+
+      d2q9_step(entry->sim, 1, &av_vel);
+      av_vels_writer_add(av_vels_out, av_vel);
+    }
+  }
+  else
+  {
+    d2q9_step(entry->sim, params.maxIters, NULL);
+  }
+
+  {
+    const double elapsed = wtime() - tic;
+    const int    ncells = params.nx * params.ny;
+    const char*  failed = NULL;   /* the output file which could not be written */
+
+    if (want_final_state)
+    {
+      float* fields = entry->fields;
+
+      d2q9_get_fields(entry->sim, fields, fields + ncells, fields + 2 * ncells, fields + 3 * ncells);
+      snprintf(filename, sizeof(filename), "%sfinal_state.dat", prefix);
+      if (write_final_state(filename, params, entry->obstacles, fields, fields + ncells, fields + 2 * ncells,
+                            fields + 3 * ncells) != EXIT_SUCCESS)
+        failed = "final_state.dat";
+    }
+
+    if (av_vels_out != NULL && av_vels_writer_close(av_vels_out) != EXIT_SUCCESS) failed = "av_vels.dat";
+
+    if (failed == NULL)
+      snprintf(reply, size, "ok %d %.12E %.6f %.6f", d2q9_iterations(entry->sim), d2q9_reynolds(entry->sim), setup,
+               elapsed);
+    else
+      snprintf(reply, size, "error could not write %s%s", prefix, failed);
+  }
+}
+
+static t_server_sim* find_sim(t_server_sim* sims, int nx, int ny)
+{
+  t_server_sim* entry = &sims[0];
+
+  for (int ss = 0; ss < SERVER_SIMS; ss++)
+  {
+    if (sims[ss].obstacles != NULL && sims[ss].nx == nx && sims[ss].ny == ny) return &sims[ss];
+  }
+
+  /* an unused entry, or else the least recently used */
+  for (int ss = 1; ss < SERVER_SIMS && entry->obstacles != NULL; ss++)
+  {
+    if (sims[ss].obstacles == NULL || sims[ss].last_used < entry->last_used) entry = &sims[ss];
+  }
+
+  if (entry->sim != NULL) d2q9_destroy(entry->sim);
+  free(entry->obstacles);
+  free(entry->fields);
+
+  entry->sim = NULL;
+  entry->nx = nx;
+  entry->ny = ny;
+  entry->obstacles = malloc(sizeof(int) * nx * ny);
+  entry->fields = malloc(sizeof(float) * 4 * nx * ny);
+
+  if (entry->obstacles == NULL || entry->fields == NULL) die("cannot allocate memory for server job", __LINE__, __FILE__);
+
+  return entry;
+}
+
+static int open_socket(const char* socketpath, int listening)
+{
+  struct sockaddr_un address;
+  struct stat        st;
+  int                fd;
+
+  if (strlen(socketpath) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "socket path is too long: %s\n", socketpath);
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socketpath);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0) return -1;
+
+  if (!listening)
+  {
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+      fprintf(stderr, "could not connect to %s: %s\n", socketpath, strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+    return fd;
+  }
+
+  /* the socket of a server which did not shut down cleanly, but no other file */
+  if (stat(socketpath, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socketpath);
+
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SERVER_BACKLOG) != 0)
+  {
+    fprintf(stderr, "could not listen on %s: %s\n", socketpath, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
@@ -0,0 +1,297 @@
+/*
+** TSC based phase timing and Chrome trace export for the timestep()
+** kernels, see instrument.h.
+*/
+
+#define _GNU_SOURCE
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<sys/time.h>
+#include <x86intrin.h>
+#include <omp.h>
+
+#include "instrument.h"
+
+#define CACHE_LINE 64
+
+/* one begin/end pair recorded by a thread */
+typedef struct
+{
+  uint64_t begin;
+  uint64_t end;
+  int32_t  phase;
+  int32_t  iter;
+} t_trace_event;
+
+/* per-thread state; only ever written by its own thread */
+typedef struct
+{
+  t_trace_event* ring;           /* preallocated ring of sampled events */
+  long           nrecorded;      /* events written, the ring slot is nrecorded % ring_events */
+  uint64_t       open[NPHASES];  /* TSC at phase_begin() */
+  uint64_t       total[NPHASES]; /* accumulated ticks over all iterations */
+  uint64_t       max[NPHASES];   /* longest single call */
+  uint64_t       calls[NPHASES];
+} t_trace_thread;
+
+typedef struct
+{
+  t_trace_thread t;
+  char pad[CACHE_LINE - sizeof(t_trace_thread) % CACHE_LINE];
+} t_trace_thread_padded;
+
+int trace_enabled = 0;
+int trace_sampled = 0;
+
+static t_trace_thread_padded* trace_threads = NULL;
+static int    trace_nthreads = 0;
+static long   trace_ring_events = 0;
+static int    trace_sample_every = 1;
+static int    trace_iter = 0;
+
+/* reference points used to convert TSC ticks to seconds */
+static uint64_t trace_tsc0;
+static double   trace_wall0;
+
+static double wall_seconds(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+/* ticks per second, calibrated over the whole interval since trace_init() */
+static double tsc_rate(void)
+{
+  uint64_t tsc = __rdtsc();
+  double   wall = wall_seconds();
+
+  if (wall - trace_wall0 <= 0.0) return 1.0e9;
+
+  return (double)(tsc - trace_tsc0) / (wall - trace_wall0);
+}
+
+int trace_init(int ring_events, int sample_every)
+{
+  int failed = 0;
+
+  trace_nthreads = omp_get_max_threads();
+  trace_ring_events = ring_events > 0 ? ring_events : 1;
+  trace_sample_every = sample_every > 0 ? sample_every : 1;
+
+  /* aligned, so that the padding keeps each thread on its own cache lines */
+  if (posix_memalign((void**)&trace_threads, CACHE_LINE, trace_nthreads * sizeof(t_trace_thread_padded)))
+  {
+    trace_threads = NULL;
+    fprintf(stderr, "timing: cannot allocate per-thread state\n");
+    return EXIT_FAILURE;
+  }
+
+  memset(trace_threads, 0, trace_nthreads * sizeof(t_trace_thread_padded));
+
+  /* each thread allocates and touches its own ring so that recording
+  ** never allocates or page faults and the pages are local to it */
+#pragma omp parallel reduction(+:failed)
+  {
+    t_trace_thread* tt = &trace_threads[omp_get_thread_num()].t;
+
+    tt->ring = malloc(sizeof(t_trace_event) * trace_ring_events);
+
+    if (tt->ring == NULL) failed++;
+    else memset(tt->ring, 0, sizeof(t_trace_event) * trace_ring_events);
+  }
+
+  if (failed)
+  {
+    fprintf(stderr, "timing: cannot allocate trace ring buffers\n");
+    trace_finalise();
+    return EXIT_FAILURE;
+  }
+
+  trace_tsc0 = __rdtsc();
+  trace_wall0 = wall_seconds();
+  trace_enabled = 1;
+
+  return EXIT_SUCCESS;
+}
+
+void trace_iteration(int tt)
+{
+  trace_iter = tt;
+  trace_sampled = (tt % trace_sample_every == 0);
+}
+
+void trace_record_begin(t_phase phase)
+{
+  int tid = omp_get_thread_num();
+
+  if (tid >= trace_nthreads) return;
+
+  trace_threads[tid].t.open[phase] = __rdtsc();
+}
+
+void trace_record_end(t_phase phase)
+{
+  uint64_t end = __rdtsc();
+  int tid = omp_get_thread_num();
+
+  if (tid >= trace_nthreads) return;
+
+  t_trace_thread* tt = &trace_threads[tid].t;
+  uint64_t ticks = end - tt->open[phase];
+
+  tt->total[phase] += ticks;
+  tt->calls[phase]++;
+  if (ticks > tt->max[phase]) tt->max[phase] = ticks;
+
+  if (trace_sampled)
+  {
+    t_trace_event* ev = &tt->ring[tt->nrecorded % trace_ring_events];
+
+    ev->begin = tt->open[phase];
+    ev->end = end;
+    ev->phase = phase;
+    ev->iter = trace_iter;
+    tt->nrecorded++;
+  }
+}
+
+void trace_report(FILE* fp, int iterations)
+{
+  double rate;
+  double step_total = 0.0;
+  int used[NPHASES];    /* phases not used by this kind of run are left out */
+
+  if (!trace_enabled) return;
+
+  rate = tsc_rate();
+
+  /* the mean over threads of the time per step spent in each phase */
+  for (int pp = 0; pp < NPHASES; pp++)
+  {
+    used[pp] = 0;
+
+    for (int tt = 0; tt < trace_nthreads; tt++)
+    {
+      step_total += trace_threads[tt].t.total[pp];
+      if (trace_threads[tt].t.calls[pp]) used[pp] = 1;
+    }
+  }
+
+  step_total /= (double)trace_nthreads;
+
+  fprintf(fp, "==timing==\n");
+  fprintf(fp, "%-22s %14s %14s %14s %14s %7s\n", "phase", "mean/step (us)",
+          "min thread (s)", "max thread (s)", "longest (us)", "share");
+
+  for (int pp = 0; pp < NPHASES; pp++)
+  {
+    double sum = 0.0, lo = 0.0, hi = 0.0;
+    uint64_t longest = 0;
+
+    if (!used[pp]) continue;
+
+    for (int tt = 0; tt < trace_nthreads; tt++)
+    {
+      const t_trace_thread* t = &trace_threads[tt].t;
+      double secs = t->total[pp] / rate;
+
+      sum += t->total[pp];
+      if (tt == 0 || secs < lo) lo = secs;
+      if (tt == 0 || secs > hi) hi = secs;
+      if (t->max[pp] > longest) longest = t->max[pp];
+    }
+
+    sum /= (double)trace_nthreads;
+
+    fprintf(fp, "%-22s %14.3f %14.6f %14.6f %14.3f %6.1f%%\n", phase_names[pp],
+            iterations > 0 ? sum / rate / iterations * 1.0e6 : 0.0,
+            lo, hi, longest / rate * 1.0e6,
+            step_total > 0.0 ? 100.0 * sum / step_total : 0.0);
+  }
+
+  fprintf(fp, "%-6s", "thread");
+  for (int pp = 0; pp < NPHASES; pp++) if (used[pp]) fprintf(fp, " %22s", phase_names[pp]);
+  fprintf(fp, "\n");
+
+  for (int tt = 0; tt < trace_nthreads; tt++)
+  {
+    fprintf(fp, "%-6d", tt);
+    for (int pp = 0; pp < NPHASES; pp++)
+    {
+      if (used[pp]) fprintf(fp, " %20.6fs", trace_threads[tt].t.total[pp] / rate);
+    }
+    fprintf(fp, "\n");
+  }
+}
+
+int trace_write_chrome(const char* filename)
+{
+  FILE* fp;
+  double us_per_tick;
+  int first = 1;
+
+  if (!trace_enabled) return EXIT_FAILURE;
+
+  fp = fopen(filename, "w");
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "timing: could not open trace file %s\n", filename);
+    return EXIT_FAILURE;
+  }
+
+  us_per_tick = 1.0e6 / tsc_rate();
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+  for (int tt = 0; tt < trace_nthreads; tt++)
+  {
+    const t_trace_thread* t = &trace_threads[tt].t;
+    long nevents = t->nrecorded < trace_ring_events ? t->nrecorded : trace_ring_events;
+    long oldest = t->nrecorded - nevents;
+
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+            "\"args\":{\"name\":\"omp thread %d\"}}", first ? "" : ",\n", tt, tt);
+    first = 0;
+
+    /* oldest first; anything older was overwritten by the ring */
+    for (long ee = oldest; ee < t->nrecorded; ee++)
+    {
+      const t_trace_event* ev = &t->ring[ee % trace_ring_events];
+
+      fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"timestep\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"iter\":%d}}",
+              phase_names[ev->phase], tt,
+              (double)(ev->begin - trace_tsc0) * us_per_tick,
+              (double)(ev->end - ev->begin) * us_per_tick, ev->iter);
+    }
+  }
+
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+void trace_finalise(void)
+{
+  if (trace_threads != NULL)
+  {
+    for (int tt = 0; tt < trace_nthreads; tt++)
+    {
+      free(trace_threads[tt].t.ring);
+    }
+  }
+
+  free(trace_threads);
+  trace_threads = NULL;
+  trace_nthreads = 0;
+  trace_enabled = 0;
+  trace_sampled = 0;
+}